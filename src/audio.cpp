@@ -0,0 +1,403 @@
+#include "audio.hpp"
+#include "player.hpp"
+#include "resampler.hpp"
+#include <SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <vector>
+
+
+namespace audio {
+namespace {
+
+
+enum {
+    RING_SIZE  = 1 << 15,
+    RING_MASK  = RING_SIZE - 1,
+    CHUNK_SIZE = 256,
+    HISTOGRAM_SIZE = Stats::HISTOGRAM_SIZE,
+#ifdef __ANDROID__
+    DEFAULT_RENDER_AHEAD = 40,
+#else
+    DEFAULT_RENDER_AHEAD = 0,
+#endif
+};
+
+
+SDL_AudioDeviceID  m_device;
+SDL_AudioSpec      m_spec;
+bool               m_direct;
+Resampler          m_resampler;
+std::vector<short> m_buffer;
+std::vector<float> m_mix;
+
+
+// render-ahead
+// single producer (render thread), single consumer (audio callback)
+int                          m_render_ahead;
+std::array<short, RING_SIZE> m_ring;
+std::atomic<uint32_t>        m_read;
+std::atomic<uint32_t>        m_write;
+std::atomic<bool>            m_paused;
+std::atomic<bool>            m_running;
+SDL_Thread*                  m_thread;
+SDL_sem*                     m_sem;
+SDL_mutex*                   m_render_mutex;
+
+
+// player time and state at the start of each chunk in the ring, so a flush can rewind to it
+struct Chunk {
+    uint32_t           time;
+    Player::Checkpoint checkpoint;
+};
+std::array<Chunk, RING_SIZE / CHUNK_SIZE> m_chunks;
+
+
+// player time of the first sample of the last delivered buffer and
+// SDL_GetTicks() of that callback, packed as time << 32 | ticks
+std::atomic<uint64_t>        m_clock;
+uint32_t                     m_latency;
+
+
+// owned by the audio callback, swapped under the device lock
+std::shared_ptr<std::vector<short> const> m_audition;
+size_t                                    m_audition_pos;
+
+
+// instrumentation, written by the audio threads
+std::atomic<uint32_t>                               m_callbacks;
+std::atomic<uint32_t>                               m_underruns;
+std::atomic<uint32_t>                               m_fallbacks;
+std::atomic<uint64_t>                               m_callback_ticks;
+Uint64                                              m_last_callback;    // 0 after a pause
+std::atomic<uint64_t>                               m_period_ticks;
+std::atomic<uint64_t>                               m_peak_load;
+std::atomic<uint64_t>                               m_render_ticks;
+std::atomic<uint64_t>                               m_render_samples;
+std::array<std::atomic<uint32_t>, HISTOGRAM_SIZE>   m_histogram;
+
+
+void timed_fill_buffer(short* buffer, int length) {
+    Uint64 t = SDL_GetPerformanceCounter();
+    player::fill_buffer(buffer, length);
+    m_render_ticks.fetch_add(SDL_GetPerformanceCounter() - t, std::memory_order_relaxed);
+    m_render_samples.fetch_add(length, std::memory_order_relaxed);
+}
+
+
+// whether the ring takes another chunk without going beyond the render-ahead length
+bool has_room() {
+    uint32_t w = m_write.load(std::memory_order_relaxed);
+    uint32_t r = m_read.load(std::memory_order_acquire);
+    return int(w - r) + CHUNK_SIZE <= m_render_ahead;
+}
+
+
+int render_thread_func(void*) {
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+    std::array<short, CHUNK_SIZE> chunk;
+    while (m_running) {
+        if (m_paused || !has_room()) {
+            SDL_SemWaitTimeout(m_sem, 5);
+            continue;
+        }
+        SDL_LockMutex(m_render_mutex);
+        // a flush may have moved the write position back since the check above
+        if (!m_paused && has_room()) {
+            uint32_t w = m_write.load(std::memory_order_relaxed);
+            m_chunks[w / CHUNK_SIZE % m_chunks.size()] = { player::time(), player::checkpoint() };
+            timed_fill_buffer(chunk.data(), chunk.size());
+            for (int i = 0; i < CHUNK_SIZE; ++i) m_ring[(w + i) & RING_MASK] = chunk[i];
+            m_write.store(w + CHUNK_SIZE, std::memory_order_release);
+        }
+        SDL_UnlockMutex(m_render_mutex);
+    }
+    return 0;
+}
+
+
+void render(short* buffer, int length, uint32_t& time) {
+    if (!m_thread) {
+        time = player::time();
+        timed_fill_buffer(buffer, length);
+        return;
+    }
+
+    uint32_t r = m_read.load(std::memory_order_relaxed);
+    uint32_t w = m_write.load(std::memory_order_acquire);
+    int n = std::min<int>(length, w - r);
+    if (n > 0) time = m_chunks[r / CHUNK_SIZE % m_chunks.size()].time + r % CHUNK_SIZE;
+    for (int i = 0; i < n; ++i) buffer[i] = m_ring[(r + i) & RING_MASK];
+    m_read.store(r + n, std::memory_order_release);
+    SDL_SemPost(m_sem);
+
+    // not enough data: render the rest ourselves unless the render thread is busy
+    if (n < length) {
+        if (SDL_TryLockMutex(m_render_mutex) == 0) {
+            m_fallbacks.fetch_add(1, std::memory_order_relaxed);
+            if (n == 0) time = player::time();
+            timed_fill_buffer(buffer + n, length - n);
+            SDL_UnlockMutex(m_render_mutex);
+        }
+        else {
+            m_underruns.fetch_add(1, std::memory_order_relaxed);
+            std::fill(buffer + n, buffer + length, 0);
+        }
+    }
+}
+
+
+void mix_audition(short* buffer, int length) {
+    if (!m_audition) return;
+    std::vector<short> const& samples = *m_audition;
+    for (int i = 0; i < length && m_audition_pos < samples.size() * 2; ++i, ++m_audition_pos) {
+        int s = buffer[i] + samples[m_audition_pos / 2];
+        buffer[i] = std::max(-32768, std::min(s, 32767));
+    }
+}
+
+
+void convert(Uint8* stream, int length, uint32_t& time) {
+    // the device runs at our rate, so there is nothing to convert
+    if (m_direct) {
+        render((short*) stream, length, time);
+        mix_audition((short*) stream, length);
+        return;
+    }
+
+    int n = m_resampler.input_length(length);
+    render(m_buffer.data(), n, time);
+    mix_audition(m_buffer.data(), n);
+    m_resampler.process(m_buffer.data(), m_mix.data(), length);
+
+    if (m_spec.format == AUDIO_F32SYS) {
+        float* out = (float*) stream;
+        for (int i = 0; i < length; ++i) {
+            for (int c = 0; c < m_spec.channels; ++c) *out++ = m_mix[i];
+        }
+    }
+    else {
+        short* out = (short*) stream;
+        for (int i = 0; i < length; ++i) {
+            short s = std::max(-32768, std::min<int>(m_mix[i] * 32768, 32767));
+            for (int c = 0; c < m_spec.channels; ++c) *out++ = s;
+        }
+    }
+}
+
+
+void audio_callback(void* userdata, Uint8* stream, int len) {
+    int length = len / (SDL_AUDIO_BITSIZE(m_spec.format) / 8 * m_spec.channels);
+
+    uint64_t clock = m_clock.load(std::memory_order_relaxed);
+    uint32_t time  = clock >> 32;
+    Uint64   t     = SDL_GetPerformanceCounter();
+    convert(stream, length, time);
+    Uint64 ticks  = SDL_GetPerformanceCounter() - t;
+    m_clock.store(uint64_t(time) << 32 | SDL_GetTicks(), std::memory_order_release);
+
+    Uint64 period = SDL_GetPerformanceFrequency() * length / m_spec.freq;
+
+    // a callback that comes late means the device ran dry. allow some jitter
+    if (m_last_callback && t - m_last_callback > period * 3 / 2) {
+        m_underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_last_callback = t;
+
+    // load in 1/1000 of the buffer period
+    uint64_t load = ticks * 1000 / std::max<Uint64>(period, 1);
+    if (load > m_peak_load.load(std::memory_order_relaxed)) m_peak_load.store(load, std::memory_order_relaxed);
+    m_histogram[std::min<int>(load / 100, HISTOGRAM_SIZE - 1)].fetch_add(1, std::memory_order_relaxed);
+    m_callback_ticks.fetch_add(ticks, std::memory_order_relaxed);
+    m_period_ticks.fetch_add(period, std::memory_order_relaxed);
+    m_callbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+bool open_device(int allowed_changes) {
+    SDL_AudioSpec spec = { MIXRATE, AUDIO_S16SYS, 1, 0, SAMPLES_PER_FRAME, 0, 0, audio_callback };
+    m_device = SDL_OpenAudioDevice(nullptr, 0, &spec, &m_spec, allowed_changes);
+    return m_device != 0;
+}
+
+
+void stop_render_thread() {
+    if (!m_thread) return;
+    m_running = false;
+    SDL_SemPost(m_sem);
+    SDL_WaitThread(m_thread, nullptr);
+    m_thread = nullptr;
+}
+
+
+void start_render_thread() {
+    m_read  = 0;
+    m_write = 0;
+    m_running = true;
+    m_thread = SDL_CreateThread(render_thread_func, "render ahead", nullptr);
+}
+
+
+} // namespace
+
+
+bool init() {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) return false;
+
+    // take whatever the device prefers as long as we know how to write it
+    if (!open_device(SDL_AUDIO_ALLOW_ANY_CHANGE)) return false;
+    if (m_spec.format != AUDIO_S16SYS && m_spec.format != AUDIO_F32SYS) {
+        SDL_CloseAudioDevice(m_device);
+        if (!open_device(SDL_AUDIO_ALLOW_ANY_CHANGE & ~SDL_AUDIO_ALLOW_FORMAT_CHANGE)) return false;
+    }
+
+    SDL_Log("audio: %d Hz, format %x, %d channels, %d samples",
+            m_spec.freq, m_spec.format, m_spec.channels, m_spec.samples);
+
+    m_direct = m_spec.freq == MIXRATE && m_spec.format == AUDIO_S16SYS && m_spec.channels == 1;
+    m_resampler.init(MIXRATE, m_spec.freq, m_spec.samples);
+    m_mix.resize(m_spec.samples);
+    m_buffer.resize(m_resampler.input_length(m_spec.samples) + 1);
+    m_latency = m_spec.samples * MIXRATE / m_spec.freq;
+
+    m_sem          = SDL_CreateSemaphore(0);
+    m_render_mutex = SDL_CreateMutex();
+    int ms = DEFAULT_RENDER_AHEAD;
+    if (char const* s = SDL_getenv("FAKESID_RENDER_AHEAD")) ms = atoi(s);
+    render_ahead(ms);
+
+    SDL_PauseAudioDevice(m_device, 0);
+    return true;
+}
+
+
+void free() {
+    Stats s = stats();
+    SDL_Log("audio: %u callbacks, load %.1f %%, peak %.1f %%, render %.1f %%, %u underruns, %u fallbacks",
+            s.callbacks, s.load, s.peak_load, s.render_load, s.underruns, s.fallbacks);
+    for (int i = 0; i < Stats::HISTOGRAM_SIZE; ++i) {
+        SDL_Log("audio: %3d%s %% %u", i * 10, i == Stats::HISTOGRAM_SIZE - 1 ? "+" : " ", s.histogram[i]);
+    }
+
+    SDL_CloseAudioDevice(m_device);
+    m_device = 0;
+    stop_render_thread();
+    SDL_DestroySemaphore(m_sem);
+    SDL_DestroyMutex(m_render_mutex);
+    m_sem          = nullptr;
+    m_render_mutex = nullptr;
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+
+void pause(bool p) {
+    if (p) {
+        m_paused = true;
+        SDL_PauseAudioDevice(m_device, 1);
+        // make sure neither the callback nor the render thread is still running
+        SDL_LockAudioDevice(m_device);
+        SDL_UnlockAudioDevice(m_device);
+        SDL_LockMutex(m_render_mutex);
+        SDL_UnlockMutex(m_render_mutex);
+    }
+    else {
+        // whatever was rendered before the pause is stale now
+        m_read.store(m_write.load());
+        m_last_callback = 0;
+        m_paused = false;
+        SDL_PauseAudioDevice(m_device, 0);
+    }
+}
+
+
+void flush() {
+    if (!m_thread) return;
+    // the chunk that is playing now stays, everything after it is rendered again
+    uint32_t r = m_read.load();
+    uint32_t w = m_write.load();
+    uint32_t b = (r + CHUNK_SIZE - 1) & ~uint32_t(CHUNK_SIZE - 1);
+    if (int(w - b) <= 0) return;
+    Chunk const& c = m_chunks[b / CHUNK_SIZE % m_chunks.size()];
+    player::rewind(c.checkpoint, c.time);
+    m_write.store(b);
+}
+
+
+void lock() {
+    SDL_LockAudioDevice(m_device);
+    SDL_LockMutex(m_render_mutex);
+}
+
+void unlock() {
+    SDL_UnlockMutex(m_render_mutex);
+    SDL_UnlockAudioDevice(m_device);
+}
+
+
+int render_ahead() { return m_render_ahead * 1000 / MIXRATE; }
+
+void render_ahead(int ms) {
+    SDL_LockAudioDevice(m_device);
+    stop_render_thread();
+    m_render_ahead = std::min(std::max(ms, 0) * MIXRATE / 1000, RING_SIZE - CHUNK_SIZE);
+    if (m_render_ahead >= CHUNK_SIZE) start_render_thread();
+    SDL_UnlockAudioDevice(m_device);
+}
+
+
+void audition(std::shared_ptr<std::vector<short> const> samples) {
+    SDL_LockAudioDevice(m_device);
+    m_audition.swap(samples);
+    m_audition_pos = 0;
+    SDL_UnlockAudioDevice(m_device);
+    // the old samples are released here, outside of the lock
+}
+
+
+player::Position playhead() {
+    uint64_t clock   = m_clock.load(std::memory_order_acquire);
+    uint32_t elapsed = std::min<uint32_t>(SDL_GetTicks() - uint32_t(clock), 1000);
+    return player::position(uint32_t(clock >> 32) + elapsed * MIXRATE / 1000 - m_latency);
+}
+
+
+uint32_t jam_time() {
+    uint64_t clock   = m_clock.load(std::memory_order_acquire);
+    uint32_t elapsed = std::min<uint32_t>(SDL_GetTicks() - uint32_t(clock), 1000) * MIXRATE / 1000;
+    return uint32_t(clock >> 32) + std::min(elapsed, m_latency) + m_latency;
+}
+
+
+Stats stats() {
+    Stats s;
+    s.callbacks = m_callbacks;
+    s.underruns = m_underruns;
+    s.fallbacks = m_fallbacks;
+    uint64_t period = m_period_ticks;
+    s.load      = period ? m_callback_ticks * 100.0f / period : 0;
+    s.peak_load = m_peak_load * 0.1f;
+    uint64_t samples = m_render_samples;
+    s.render_load = samples ? m_render_ticks * 100.0f * MIXRATE / (samples * SDL_GetPerformanceFrequency()) : 0;
+    for (int i = 0; i < Stats::HISTOGRAM_SIZE; ++i) s.histogram[i] = m_histogram[i];
+    return s;
+}
+
+
+void reset_stats() {
+    m_callbacks      = 0;
+    m_underruns      = 0;
+    m_fallbacks      = 0;
+    m_callback_ticks = 0;
+    m_period_ticks   = 0;
+    m_peak_load      = 0;
+    m_render_ticks   = 0;
+    m_render_samples = 0;
+    for (auto& h : m_histogram) h = 0;
+}
+
+
+int device_rate() { return m_spec.freq; }
+
+
+} // namespace
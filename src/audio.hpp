@@ -0,0 +1,51 @@
+#pragma once
+#include "player.hpp"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+namespace audio {
+    struct Stats {
+        enum { HISTOGRAM_SIZE = 11 };
+        uint32_t callbacks;
+        uint32_t underruns;     // callbacks padded with silence, or that came late
+        uint32_t fallbacks;     // callbacks that rendered what the ring lacked themselves
+        float    load;          // average callback time in percent of the buffer period
+        float    peak_load;     // worst callback
+        float    render_load;   // synthesis time in percent of the audio rendered
+        std::array<uint32_t, HISTOGRAM_SIZE> histogram; // callback load in steps of 10 %
+    };
+
+    bool init();
+    void free();
+    void pause(bool p);
+
+    // take back audio that was rendered ahead but not played yet, so a jam or transport
+    // command is heard right away. call it with the lock held, before changing the player
+    void flush();
+
+    // keep the synth from running without pausing the device, e.g. while the song grows
+    void lock();
+    void unlock();
+
+    // 0 renders synchronously in the audio callback
+    int  render_ahead();
+    void render_ahead(int ms);
+
+    // position that is audible right now, compensated for buffering and device latency
+    player::Position playhead();
+    // sample time for a jam event, one device buffer after the one playing now,
+    // so events keep their spacing at a constant latency
+    uint32_t jam_time();
+
+    Stats stats();
+    void  reset_stats();
+
+    int  device_rate();
+
+    // play samples at half the mix rate on top of the song, e.g. a song preview.
+    // nullptr stops it
+    void audition(std::shared_ptr<std::vector<short> const> samples);
+}
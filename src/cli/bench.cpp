@@ -0,0 +1,182 @@
+#include "server.hpp"
+#include "../pack.hpp"
+#include "../player.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// the load test client of the render daemon
+
+
+namespace server {
+namespace {
+
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Result {
+    uint32_t status;
+    uint32_t frames;
+    double   latency;   // seconds to the first frames
+    double   time;      // seconds to the end of the job
+};
+
+
+bool read_all(int fd, void* data, size_t size) {
+    uint8_t* p = (uint8_t*) data;
+    while (size > 0) {
+        ssize_t len = recv(fd, p, size, 0);
+        if (len <= 0) return false;
+        p    += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+bool write_all(int fd, void const* data, size_t size) {
+    uint8_t const* p = (uint8_t const*) data;
+    while (size > 0) {
+        ssize_t len = send(fd, p, size, 0);
+        if (len < 0) return false;
+        p    += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+// returns false if the connection failed
+bool run_job(std::string const& path, std::vector<uint8_t> const& song, uint32_t flags,
+             uint32_t max_frames, uint32_t cancel_frames, Result& r) {
+    Clock::time_point start = Clock::now();
+    r = {};
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    Request req = { { 'F', 'S', 'R', 'Q' }, uint32_t(song.size()), flags, max_frames };
+    bool ok = write_all(fd, &req, sizeof(req)) && write_all(fd, song.data(), song.size());
+
+    // a busy server answers right away, without reading the request
+    std::vector<uint8_t> payload;
+    uint32_t channels = 1;
+    bool     canceled = false;
+    for (;;) {
+        uint32_t header[2];
+        if (!read_all(fd, header, sizeof(header))) {
+            ok = false;
+            break;
+        }
+        payload.resize(header[1]);
+        if (!read_all(fd, payload.data(), payload.size())) {
+            ok = false;
+            break;
+        }
+        if (header[0] == MSG_FORMAT && payload.size() >= 4) {
+            memcpy(&channels, payload.data(), 4);
+        }
+        else if (header[0] == MSG_PCM) {
+            if (r.frames == 0) r.latency = std::chrono::duration<double>(Clock::now() - start).count();
+            r.frames += payload.size() / (channels * sizeof(short));
+            if (cancel_frames > 0 && r.frames >= cancel_frames && !canceled) {
+                canceled = true;
+                write_all(fd, "", 1);
+            }
+        }
+        else if (header[0] == MSG_END && payload.size() >= 4) {
+            memcpy(&r.status, payload.data(), 4);
+            ok = true;
+            break;
+        }
+    }
+    close(fd);
+    r.time = std::chrono::duration<double>(Clock::now() - start).count();
+    return ok;
+}
+
+
+void print_percentiles(char const* name, std::vector<double> v) {
+    if (v.empty()) return;
+    std::sort(v.begin(), v.end());
+    auto p = [&](double q) { return v[std::min<size_t>(v.size() - 1, q * v.size())] * 1000; };
+    printf("%-10s p50 %8.2f ms  p90 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+           name, p(0.5), p(0.9), p(0.99), v.back() * 1000);
+}
+
+
+} // namespace
+
+
+int bench(std::string const& path, std::string const& song_path, int jobs, int clients,
+          uint32_t flags, uint32_t max_frames, uint32_t cancel_frames) {
+    std::vector<uint8_t> song;
+    if (!pack::read(song_path, song)) {
+        fprintf(stderr, "error: cannot read %s\n", song_path.c_str());
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<Result> results(jobs);
+    std::vector<char>   connected(jobs);
+    std::atomic<int>    next(0);
+    Clock::time_point   start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::max(1, clients); ++t) {
+        threads.emplace_back([&]() {
+            for (int i; (i = next++) < jobs;) {
+                connected[i] = run_job(path, song, flags, max_frames, cancel_frames, results[i]);
+            }
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    double wall_time = std::chrono::duration<double>(Clock::now() - start).count();
+
+    int    count[4]   = {};
+    int    failed     = 0;
+    double audio_time = 0;
+    std::vector<double> latencies;
+    std::vector<double> times;
+    for (int i = 0; i < jobs; ++i) {
+        Result const& r = results[i];
+        if (!connected[i] || r.status > STATUS_BUSY) {
+            ++failed;
+            continue;
+        }
+        ++count[r.status];
+        audio_time += double(r.frames) / MIXRATE;
+        if (r.status == STATUS_BUSY) continue;
+        if (r.frames > 0) latencies.push_back(r.latency);
+        times.push_back(r.time);
+    }
+
+    // jobs turned away by a busy server do not count as served
+    int served = count[STATUS_OK] + count[STATUS_CANCELED];
+    printf("%d jobs on %d connections in %.2f s: %.2f jobs/s served, %.0fx realtime\n",
+           jobs, clients, wall_time, served / std::max(wall_time, 1e-6), audio_time / std::max(wall_time, 1e-6));
+    printf("%d ok, %d canceled, %d bad song, %d busy, %d failed\n",
+           count[STATUS_OK], count[STATUS_CANCELED], count[STATUS_BAD_SONG], count[STATUS_BUSY], failed);
+    print_percentiles("first pcm", latencies);
+    print_percentiles("job", times);
+    return failed > 0 || count[STATUS_BAD_SONG] > 0 ? 1 : 0;
+}
+
+
+} // namespace
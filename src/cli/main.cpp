@@ -0,0 +1,435 @@
+#include "../pack.hpp"
+#include "../file.hpp"
+#include "../exporter.hpp"
+#include "../render_cache.hpp"
+#include "server.hpp"
+#include "stream.hpp"
+#include "../player.hpp"
+#include "../resampler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+// headless tools for song libraries
+//
+//   fakesid-cli pack <song dir> <pack>
+//   fakesid-cli unpack <pack> <song dir>
+//   fakesid-cli list <pack>
+//   fakesid-cli render [-j jobs] [-f formats] [-q quality] [-c cache dir] [-m cache MB]
+//                      <out dir> <song, song dir or pack>...
+//
+// render exports every song with its own player, by default one worker per core.
+// formats is a comma separated list of ogg, wav, flac and stems, ogg by default,
+// and quality from 0 to 1 is for ogg. with a cache dir, unchanged songs are copied
+// from earlier renders. song names must be unique across all inputs.
+//
+//   fakesid-cli serve [-j workers] <socket>
+//   fakesid-cli bench [-n jobs] [-c connections] [-l seconds] [-x seconds] [-s] <socket> <song>
+//
+// serve runs the render daemon, see server.hpp. bench loads it with renders of one song,
+// each limited to -l seconds and canceled after -x seconds of audio, with stems for -s.
+//
+//   fakesid-cli stream [-o out] [-x seconds] [-l] [-u] <song, song dir or pack>...
+//
+// stream plays the songs as raw pcm to stdout or -o, see stream.hpp. -x crossfades,
+// -l loops the playlist and -u writes as fast as the reader takes it.
+//
+//   fakesid-cli resample [-n samples] <device rate>...
+//
+// resample times the resampler the app uses when the device does not run at the mix rate,
+// in callbacks of -n output samples, 1024 by default.
+
+
+namespace {
+
+
+int usage() {
+    fprintf(stderr,
+            "usage: fakesid-cli pack <song dir> <pack>\n"
+            "       fakesid-cli unpack <pack> <song dir>\n"
+            "       fakesid-cli list <pack>\n"
+            "       fakesid-cli render [-j jobs] [-f formats] [-q quality] [-c cache dir] [-m cache MB]\n"
+            "                          <out dir> <song, song dir or pack>...\n"
+            "       fakesid-cli serve [-j workers] <socket>\n"
+            "       fakesid-cli bench [-n jobs] [-c connections] [-l seconds] [-x seconds] [-s] <socket> <song>\n"
+            "       fakesid-cli stream [-o out] [-x seconds] [-l] [-u] <song, song dir or pack>...\n"
+            "       fakesid-cli resample [-n samples] <device rate>...\n");
+    return 1;
+}
+
+
+bool ends_with(std::string const& s, std::string const& suffix) {
+    return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+
+bool is_dir(std::string const& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+// the song files of a directory, sorted
+bool list_dir(std::string dir, std::vector<std::string>& files) {
+    if (dir.back() != '/') dir += '/';
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "error: cannot open %s\n", dir.c_str());
+        return false;
+    }
+    size_t first = files.size();
+    while (struct dirent* ent = readdir(d)) {
+        std::string name = ent->d_name;
+        if (ends_with(name, ".sng")) files.push_back(dir + name);
+    }
+    closedir(d);
+    std::sort(files.begin() + first, files.end());
+    return true;
+}
+
+
+int pack_dir(std::string const& dir, std::string const& path) {
+    std::vector<std::string> files;
+    if (!list_dir(dir, files)) return 1;
+
+    if (!pack::write(path, files)) {
+        fprintf(stderr, "error: cannot write %s\n", path.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+
+int unpack(std::string const& path, std::string dir) {
+    if (dir.back() != '/') dir += '/';
+    pack::Pack p;
+    if (!p.open(path)) {
+        fprintf(stderr, "error: cannot open %s\n", path.c_str());
+        return 1;
+    }
+    for (int i = 0; i < p.count(); ++i) {
+        pack::Entry const& e = p.entry(i);
+        std::string name = dir + e.name + ".sng";
+        if (!file::write_atomic(name, p.data(e), e.length)) {
+            fprintf(stderr, "error: cannot write %s\n", name.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int list(std::string const& path) {
+    pack::Pack p;
+    if (!p.open(path)) {
+        fprintf(stderr, "error: cannot open %s\n", path.c_str());
+        return 1;
+    }
+    for (int i = 0; i < p.count(); ++i) {
+        pack::Entry const& e = p.entry(i);
+        printf("%016llx %8u  %-31s %s\n", (unsigned long long) e.hash, e.length, e.name, e.title);
+    }
+    return 0;
+}
+
+
+struct Job {
+    std::string           name;     // of the output files, without suffix
+    std::string           path;     // the song was read from
+    std::unique_ptr<Song> song;
+    int                   samples;
+    bool                  ok;
+    bool                  cached;
+    double                time;
+};
+
+
+bool add_job(std::vector<Job>& jobs, std::string const& name, std::string const& path,
+             uint8_t const* data, size_t size) {
+    Job job = { name, path, std::unique_ptr<Song>(new Song()) };
+    if (!load_song(*job.song, data, size)) {
+        fprintf(stderr, "error: cannot load %s\n", path.c_str());
+        return false;
+    }
+    job.samples = song_frame_count(*job.song) * SAMPLES_PER_FRAME;
+    jobs.push_back(std::move(job));
+    return true;
+}
+
+
+// the songs of a song file, song directory or pack, as paths for pack::read
+bool list_songs(std::string const& input, std::vector<std::string>& paths) {
+    if (ends_with(input, PACK_SUFFIX)) {
+        pack::Pack p;
+        if (!p.open(input)) {
+            fprintf(stderr, "error: cannot open %s\n", input.c_str());
+            return false;
+        }
+        for (int i = 0; i < p.count(); ++i) paths.push_back(input + "/" + p.entry(i).name);
+        return true;
+    }
+    if (!is_dir(input)) {
+        paths.push_back(input);
+        return true;
+    }
+    return list_dir(input, paths);
+}
+
+
+bool add_jobs(std::vector<Job>& jobs, std::string const& input) {
+    std::vector<std::string> paths;
+    if (!list_songs(input, paths)) return false;
+    for (std::string const& path : paths) {
+        std::vector<uint8_t> data;
+        if (!pack::read(path, data)) {
+            fprintf(stderr, "error: cannot read %s\n", path.c_str());
+            return false;
+        }
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        if (ends_with(name, ".sng")) name.resize(name.size() - 4);
+        if (!add_job(jobs, name, path, data.data(), data.size())) return false;
+    }
+    return true;
+}
+
+
+bool parse_formats(std::string const& str, float quality, std::vector<exporter::Target>& targets) {
+    size_t pos = 0;
+    while (pos <= str.size()) {
+        size_t end = std::min(str.find(',', pos), str.size());
+        std::string f = str.substr(pos, end - pos);
+        if      (f == "ogg")   targets.push_back({ exporter::OGG, quality });
+        else if (f == "wav")   targets.push_back({ exporter::WAV });
+        else if (f == "flac")  targets.push_back({ exporter::FLAC });
+        else if (f == "stems") targets.push_back({ exporter::STEMS });
+        else {
+            fprintf(stderr, "error: unknown format %s\n", f.c_str());
+            return false;
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+
+int render(int argc, char** argv) {
+    int         threads = std::thread::hardware_concurrency();
+    std::string formats = "ogg";
+    float       quality = -1;
+    std::string cache_dir;
+    int         cache_size = 4096;
+    int i = 2;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        std::string opt = argv[i];
+        if      (opt == "-j") threads = atoi(argv[i + 1]);
+        else if (opt == "-f") formats = argv[i + 1];
+        else if (opt == "-q") quality = atof(argv[i + 1]);
+        else if (opt == "-c") cache_dir = argv[i + 1];
+        else if (opt == "-m") cache_size = atoi(argv[i + 1]);
+        else return usage();
+    }
+    if (argc - i < 2) return usage();
+
+    std::vector<exporter::Target> targets;
+    if (!parse_formats(formats, quality, targets)) return 1;
+
+    std::string dir = argv[i++];
+    if (dir.back() != '/') dir += '/';
+    if (!is_dir(dir) && mkdir(dir.c_str(), 0755) != 0) {
+        fprintf(stderr, "error: cannot create %s\n", dir.c_str());
+        return 1;
+    }
+
+    if (!cache_dir.empty()) {
+        if (cache_dir.back() != '/') cache_dir += '/';
+        render_cache::init(cache_dir, uint64_t(cache_size) << 20);
+    }
+
+    std::vector<Job> jobs;
+    for (; i < argc; ++i) {
+        if (!add_jobs(jobs, argv[i])) return 1;
+    }
+
+    // songs of the same name from different places would write the same files
+    std::sort(jobs.begin(), jobs.end(), [](Job const& a, Job const& b) { return a.name < b.name; });
+    for (size_t j = 1; j < jobs.size(); ++j) {
+        if (jobs[j].name != jobs[j - 1].name) continue;
+        fprintf(stderr, "error: %s and %s both render to %s%s\n",
+                jobs[j - 1].path.c_str(), jobs[j].path.c_str(), dir.c_str(), jobs[j].name.c_str());
+        return 1;
+    }
+
+    // songs are rendered whole, so longest first keeps the workers busy to the end:
+    // each idle worker takes the next song, and only short ones are left for the tail
+    std::sort(jobs.begin(), jobs.end(), [](Job const& a, Job const& b) { return a.samples > b.samples; });
+    threads = std::max(1, std::min<int>(threads, jobs.size()));
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int j; (j = next++) < (int) jobs.size();) {
+            Job& job = jobs[j];
+            exporter::Stats stats = {};
+            job.ok     = exporter::render(*job.song, dir + job.name, targets, &stats);
+            job.cached = job.ok && stats.cache_hits == (int) targets.size();
+            job.time   = stats.wall_time;
+            job.song.reset();
+            double audio_time = double(job.samples) / MIXRATE;
+            printf("%-31s %7.1f s  %6.2f s  %5.0fx%s\n", job.name.c_str(), audio_time, job.time,
+                   audio_time / std::max(job.time, 1e-6), !job.ok ? "  failed" : job.cached ? "  cached" : "");
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) workers.emplace_back(work);
+    work();
+    for (std::thread& w : workers) w.join();
+    double wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int    failed     = 0;
+    int    cached     = 0;
+    double audio_time = 0;
+    for (Job const& job : jobs) {
+        failed     += !job.ok;
+        cached     += job.cached;
+        audio_time += double(job.samples) / MIXRATE;
+    }
+    printf("%d songs (%d cached), %.1f s of audio in %.2f s on %d threads: %.2f songs/s, %.0fx realtime\n",
+           (int) jobs.size(), cached, audio_time, wall_time, threads,
+           jobs.size() / std::max(wall_time, 1e-6), audio_time / std::max(wall_time, 1e-6));
+    render_cache::free();
+    if (failed > 0) {
+        fprintf(stderr, "error: %d songs failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
+
+int serve(int argc, char** argv) {
+    int workers = std::thread::hardware_concurrency();
+    int i = 2;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-j") == 0) workers = atoi(argv[i + 1]);
+        else return usage();
+    }
+    if (argc - i != 1) return usage();
+    return server::serve(argv[i], std::max(1, workers));
+}
+
+
+int bench(int argc, char** argv) {
+    int      jobs    = 100;
+    int      clients = 4;
+    uint32_t flags   = 0;
+    float    length  = 0;
+    float    cancel  = 0;
+    int i = 2;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        std::string opt = argv[i];
+        if (opt == "-s") {
+            flags |= server::REQUEST_STEMS;
+            continue;
+        }
+        if (i + 1 == argc) return usage();
+        char const* arg = argv[++i];
+        if      (opt == "-n") jobs    = atoi(arg);
+        else if (opt == "-c") clients = atoi(arg);
+        else if (opt == "-l") length  = atof(arg);
+        else if (opt == "-x") cancel  = atof(arg);
+        else return usage();
+    }
+    if (argc - i != 2) return usage();
+    return server::bench(argv[i], argv[i + 1], jobs, clients, flags, length * MIXRATE, cancel * MIXRATE);
+}
+
+
+int play(int argc, char** argv) {
+    std::string out       = "-";
+    float       crossfade = 0;
+    bool        loop      = false;
+    bool        paced     = true;
+    int i = 2;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        std::string opt = argv[i];
+        if      (opt == "-l") loop  = true;
+        else if (opt == "-u") paced = false;
+        else if (i + 1 == argc) return usage();
+        else if (opt == "-o") out       = argv[++i];
+        else if (opt == "-x") crossfade = atof(argv[++i]);
+        else return usage();
+    }
+    if (i == argc) return usage();
+
+    std::vector<std::string> songs;
+    for (; i < argc; ++i) {
+        if (!list_songs(argv[i], songs)) return 1;
+    }
+    return stream::play(songs, out, crossfade, loop, paced);
+}
+
+
+int resample(int argc, char** argv) {
+    int length = 1024;
+    int i = 2;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        std::string opt = argv[i];
+        if (opt == "-n") length = std::max(1, atoi(argv[i + 1]));
+        else return usage();
+    }
+    if (i == argc) return usage();
+
+    // ten seconds of a sine, fed in as many calls as the device would make
+    enum { SECONDS = 10 };
+    std::vector<short> in(MIXRATE * SECONDS + MIXRATE);
+    for (size_t k = 0; k < in.size(); ++k) in[k] = sinf(k * 0.0628f) * 16000;
+    std::vector<float> out(length);
+    for (; i < argc; ++i) {
+        int rate = atoi(argv[i]);
+        if (rate <= 0) return usage();
+        Resampler r;
+        r.init(MIXRATE, rate, length);
+        int    calls = int64_t(rate) * SECONDS / length;
+        size_t pos   = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int c = 0; c < calls; ++c) {
+            int n = r.input_length(length);
+            r.process(in.data() + pos, out.data(), length);
+            pos += n;
+        }
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        // a rate converter that loses or repeats samples drifts away from the exact count
+        printf("%6d Hz: %5.2f ns per sample, %6.0fx realtime, %zu input samples for %.1f\n",
+               rate, time * 1e9 / (double(calls) * length), SECONDS / std::max(time, 1e-9),
+               pos, double(calls) * length * MIXRATE / rate);
+    }
+    return 0;
+}
+
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    if (argc < 2) return usage();
+    std::string cmd = argv[1];
+    if (cmd == "pack" && argc == 4)   return pack_dir(argv[2], argv[3]);
+    if (cmd == "unpack" && argc == 4) return unpack(argv[2], argv[3]);
+    if (cmd == "list" && argc == 3)   return list(argv[2]);
+    if (cmd == "render")              return render(argc, argv);
+    if (cmd == "serve")               return serve(argc, argv);
+    if (cmd == "bench")               return bench(argc, argv);
+    if (cmd == "stream")              return play(argc, argv);
+    if (cmd == "resample")            return resample(argc, argv);
+    return usage();
+}
@@ -0,0 +1,250 @@
+#include "server.hpp"
+#include "../player.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace server {
+namespace {
+
+
+enum {
+    // small, so the first frames go out quickly
+    BLOCK_FRAMES  = 2048,
+    // connections waiting for a worker, more are turned away
+    MAX_PENDING   = 64,
+    MAX_SONG_SIZE = 1 << 20,
+    // seconds a client may stall a read or write before its job ends
+    IO_TIMEOUT    = 10,
+};
+
+
+// the song and player of a worker are reused for all its jobs
+struct Engine {
+    Song                 song;
+    Player               player{ song };
+    std::vector<uint8_t> data;
+    std::vector<short>   buffer;
+};
+
+
+std::mutex              m_mutex;
+std::condition_variable m_cond;
+std::deque<int>         m_pending;
+std::vector<int>        m_active;   // the connection of each worker, or -1
+std::atomic<int>        m_jobs;
+std::atomic<bool>       m_stop;
+
+
+bool read_all(int fd, void* data, size_t size) {
+    uint8_t* p = (uint8_t*) data;
+    while (size > 0) {
+        ssize_t len = recv(fd, p, size, 0);
+        if (len <= 0) return false;
+        p    += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+bool write_all(int fd, void const* data, size_t size) {
+    uint8_t const* p = (uint8_t const*) data;
+    while (size > 0) {
+        ssize_t len = send(fd, p, size, 0);
+        if (len < 0) return false;
+        p    += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+bool send_msg(int fd, uint32_t type, void const* data, uint32_t size) {
+    uint32_t header[] = { type, size };
+    return write_all(fd, header, sizeof(header)) && write_all(fd, data, size);
+}
+
+
+void send_end(int fd, uint32_t status) {
+    send_msg(fd, MSG_END, &status, sizeof(status));
+}
+
+
+// anything the client sends after the request cancels the job, and so does hanging up
+bool is_canceled(int fd) {
+    pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, 0) > 0;
+}
+
+
+void run_job(int fd, Engine& e) {
+    Request req;
+    if (!read_all(fd, &req, sizeof(req))) return;
+    if (memcmp(req.magic, "FSRQ", 4) != 0 || req.song_size > MAX_SONG_SIZE) {
+        send_end(fd, STATUS_BAD_SONG);
+        return;
+    }
+    e.data.resize(req.song_size);
+    if (!read_all(fd, e.data.data(), e.data.size())) return;
+    if (!load_song(e.song, e.data.data(), e.data.size())) {
+        send_end(fd, STATUS_BAD_SONG);
+        return;
+    }
+
+    uint32_t channels = req.flags & REQUEST_STEMS ? Player::STEM_CHANNELS : 1;
+    uint32_t frames   = song_frame_count(e.song) * SAMPLES_PER_FRAME;
+    if (req.max_frames > 0) frames = std::min(frames, req.max_frames);
+    uint32_t format[] = { channels, MIXRATE, frames };
+    if (!send_msg(fd, MSG_FORMAT, format, sizeof(format))) return;
+
+    // reset drops all pointers into the previous song
+    e.player.block_loop(false);
+    e.player.set_playing(true);
+    e.player.reset();
+    e.buffer.resize(BLOCK_FRAMES * channels);
+
+    uint32_t status = STATUS_OK;
+    for (uint32_t pos = 0; pos < frames; pos += BLOCK_FRAMES) {
+        if (m_stop || is_canceled(fd)) {
+            status = STATUS_CANCELED;
+            break;
+        }
+        int length = std::min<uint32_t>(frames - pos, BLOCK_FRAMES);
+        if (channels > 1) e.player.fill_stems(e.buffer.data(), length);
+        else              e.player.fill_buffer(e.buffer.data(), length);
+        if (!send_msg(fd, MSG_PCM, e.buffer.data(), length * channels * sizeof(short))) return;
+    }
+    send_end(fd, status);
+}
+
+
+void worker_func(int index) {
+    std::unique_ptr<Engine> engine(new Engine());
+    reserve_song(engine->song);
+    for (;;) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [] { return m_stop || !m_pending.empty(); });
+            if (m_pending.empty()) return;
+            fd = m_pending.front();
+            m_pending.pop_front();
+            m_active[index] = fd;
+        }
+        run_job(fd, *engine);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_active[index] = -1;
+        }
+        close(fd);
+        ++m_jobs;
+    }
+}
+
+
+void stop(int) {
+    m_stop = true;
+}
+
+
+} // namespace
+
+
+int serve(std::string const& path, int workers) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // a socket left over from an earlier run
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, MAX_PENDING) != 0) {
+        fprintf(stderr, "error: cannot listen on %s\n", path.c_str());
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // a client hanging up must not kill the server, and a stop interrupts accept
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = {};
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    // only this thread takes the stop signals, the workers inherit the blocked mask
+    sigset_t signals, old_mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+    m_active.assign(workers, -1);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; ++i) threads.emplace_back(worker_func, i);
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    printf("serving on %s with %d workers\n", path.c_str(), workers);
+    fflush(stdout);
+
+    while (!m_stop) {
+        int c = accept(fd, nullptr, nullptr);
+        if (c < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        timeval timeout = { IO_TIMEOUT, 0 };
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_pending.size() >= MAX_PENDING) {
+            lock.unlock();
+            send_end(c, STATUS_BUSY);
+            close(c);
+            continue;
+        }
+        m_pending.push_back(c);
+        m_cond.notify_one();
+    }
+
+    close(fd);
+    unlink(path.c_str());
+
+    // drop waiting jobs and end running ones, even if their client stopped reading
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int c : m_pending) close(c);
+        m_pending.clear();
+        for (int c : m_active) {
+            if (c >= 0) shutdown(c, SHUT_RDWR);
+        }
+        m_cond.notify_all();
+    }
+    for (std::thread& t : threads) t.join();
+    printf("served %d jobs\n", m_jobs.load());
+    return 0;
+}
+
+
+} // namespace
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+
+// a render daemon on a unix socket, so tools can render without starting a process per song.
+//
+// a connection carries one job:
+//
+//   client: Request, song data, then optionally any byte to cancel
+//   server: messages of u32 type, u32 size and payload:
+//           MSG_FORMAT  u32 channels, u32 rate, u32 frames to come
+//           MSG_PCM     interleaved 16 bit frames, as soon as they are rendered
+//           MSG_END     u32 status
+//
+// numbers are in host byte order, the socket is local. the server blocks while the client
+// is not reading, so a slow client holds back its own render and nothing else.
+// a client that stalls a read or write for ten seconds loses its connection.
+namespace server {
+    enum {
+        REQUEST_STEMS = 1,
+    };
+
+    struct Request {
+        char     magic[4];      // "FSRQ"
+        uint32_t song_size;
+        uint32_t flags;
+        uint32_t max_frames;    // 0 for the whole song
+    };
+
+    enum { MSG_FORMAT, MSG_PCM, MSG_END };
+    enum { STATUS_OK, STATUS_CANCELED, STATUS_BAD_SONG, STATUS_BUSY };
+
+    int serve(std::string const& path, int workers);
+    // `jobs` renders of the song by `clients` concurrent connections; each is canceled
+    // after `cancel_frames` if that is not 0
+    int bench(std::string const& path, std::string const& song_path, int jobs, int clients,
+              uint32_t flags, uint32_t max_frames, uint32_t cancel_frames);
+}
@@ -0,0 +1,195 @@
+#include "stream.hpp"
+#include "../player.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace stream {
+namespace {
+
+
+using Clock = std::chrono::steady_clock;
+
+enum {
+    BLOCK_FRAMES = 1024,
+};
+
+// how far the output runs ahead of real time, so the reader never waits on us
+constexpr double LEAD_SECONDS = 0.1;
+
+
+// a song with its own player. the first frames are rendered ahead, when the song is loaded
+struct Engine {
+    Song               song;
+    Player             player{ song };
+    int                index;       // in the playlist, -1 if nothing is loaded
+    int                frames;
+    int                pos;
+    std::vector<short> preroll;
+};
+
+
+struct Output {
+    int               fd;
+    bool              paced;
+    Clock::time_point start;
+    uint64_t          frames;
+};
+
+
+std::vector<std::string> const* m_songs;
+bool                            m_loop;
+int                             m_preroll_frames;
+
+
+// load the first song that loads from `index` on, going round the playlist when looping
+void prepare(Engine& e, int index) {
+    e.index = -1;
+    int count = m_songs->size();
+    for (int i = 0; i < count; ++i, ++index) {
+        if (index >= count) {
+            if (!m_loop) return;
+            index = 0;
+        }
+        if (load_song(e.song, (*m_songs)[index].c_str())) {
+            e.index = index;
+            break;
+        }
+        fprintf(stderr, "error: cannot load %s\n", (*m_songs)[index].c_str());
+    }
+    if (e.index < 0) return;
+
+    e.frames = song_frame_count(e.song) * SAMPLES_PER_FRAME;
+    e.pos    = 0;
+    e.player.block_loop(false);
+    e.player.set_playing(true);
+    e.player.reset();
+    e.preroll.resize(std::min(m_preroll_frames, e.frames));
+    e.player.fill_buffer(e.preroll.data(), e.preroll.size());
+}
+
+
+void read(Engine& e, short* buffer, int length) {
+    int n = std::max(0, std::min<int>(length, e.preroll.size() - e.pos));
+    std::copy(e.preroll.begin() + e.pos, e.preroll.begin() + e.pos + n, buffer);
+    if (length > n) e.player.fill_buffer(buffer + n, length - n);
+    e.pos += length;
+}
+
+
+bool write(Output& out, short const* buffer, int length) {
+    if (out.paced) {
+        double t = double(out.frames) / MIXRATE - LEAD_SECONDS;
+        std::this_thread::sleep_until(out.start + std::chrono::duration_cast<Clock::duration>(
+                                      std::chrono::duration<double>(t)));
+    }
+    uint8_t const* p = (uint8_t const*) buffer;
+    size_t size = length * sizeof(short);
+    while (size > 0) {
+        ssize_t len = ::write(out.fd, p, size);
+        if (len < 0) return false;
+        p    += len;
+        size -= len;
+    }
+    out.frames += length;
+    return true;
+}
+
+
+// play the song up to frame `end`
+bool play_to(Output& out, Engine& e, int end) {
+    short buffer[BLOCK_FRAMES];
+    while (e.pos < end) {
+        int length = std::min<int>(end - e.pos, BLOCK_FRAMES);
+        read(e, buffer, length);
+        if (!write(out, buffer, length)) return false;
+    }
+    return true;
+}
+
+
+// equal power, the songs are unrelated
+bool crossfade(Output& out, Engine& a, Engine& b, int length) {
+    short buffer_a[BLOCK_FRAMES];
+    short buffer_b[BLOCK_FRAMES];
+    for (int i = 0; i < length; i += BLOCK_FRAMES) {
+        int n = std::min<int>(length - i, BLOCK_FRAMES);
+        read(a, buffer_a, n);
+        read(b, buffer_b, n);
+        for (int j = 0; j < n; ++j) {
+            float x = float(i + j) / length * float(M_PI / 2);
+            float v = buffer_a[j] * std::cos(x) + buffer_b[j] * std::sin(x);
+            buffer_a[j] = std::max(-32768.0f, std::min(32767.0f, v));
+        }
+        if (!write(out, buffer_a, n)) return false;
+    }
+    return true;
+}
+
+
+} // namespace
+
+
+int play(std::vector<std::string> const& songs, std::string const& path,
+         float crossfade_seconds, bool loop, bool paced) {
+    // a reader going away ends the stream
+    signal(SIGPIPE, SIG_IGN);
+
+    Output out = { 1, paced };
+    if (path != "-") {
+        // opening a fifo waits for the reader
+        out.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out.fd < 0) {
+            fprintf(stderr, "error: cannot open %s\n", path.c_str());
+            return 1;
+        }
+    }
+
+    int fade_frames  = std::max(0.0f, crossfade_seconds) * MIXRATE;
+    m_songs          = &songs;
+    m_loop           = loop;
+    m_preroll_frames = std::max<int>(fade_frames, BLOCK_FRAMES);
+
+    std::unique_ptr<Engine> cur(new Engine());
+    std::unique_ptr<Engine> next(new Engine());
+    reserve_song(cur->song);
+    reserve_song(next->song);
+    prepare(*cur, 0);
+    if (cur->index < 0) return 1;
+
+    fprintf(stderr, "streaming %d Hz mono 16 bit pcm\n", MIXRATE);
+    out.start = Clock::now();
+    for (;;) {
+        fprintf(stderr, "playing %s\n", songs[cur->index].c_str());
+
+        std::thread preload(prepare, std::ref(*next), cur->index + 1);
+
+        // the fade can start no earlier than here, we know how long it is once the next song is loaded
+        int fade = std::min(fade_frames, cur->frames - cur->pos);
+        bool ok = play_to(out, *cur, cur->frames - fade);
+        preload.join();
+        if (!ok) break;
+
+        if (next->index < 0) {
+            play_to(out, *cur, cur->frames);
+            break;
+        }
+        fade = std::min(fade, next->frames);
+        if (!play_to(out, *cur, cur->frames - fade)) break;
+        if (!crossfade(out, *cur, *next, fade)) break;
+        std::swap(cur, next);
+    }
+
+    if (out.fd != 1) close(out.fd);
+    return 0;
+}
+
+
+} // namespace
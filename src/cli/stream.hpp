@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include <vector>
+
+
+// a playlist as raw pcm (16 bit mono at MIXRATE, host byte order) to stdout, a file or a fifo,
+// at the pace of real time and without gaps. while a song plays, the next one is loaded
+// and its beginning rendered on a second player, so the transition costs nothing
+namespace stream {
+    // `path` "-" is stdout. the songs overlap by `crossfade` seconds.
+    // with `loop` the playlist repeats, without `paced` it is written as fast as it is read
+    int play(std::vector<std::string> const& songs, std::string const& path,
+             float crossfade, bool loop, bool paced);
+}
@@ -7,15 +7,15 @@
 #include "help_view.hpp"
 #include "gui.hpp"
 #include "player.hpp"
+#include "audio.hpp"
+#include "journal.hpp"
+#include "history.hpp"
+#include "input.hpp"
 
 
 namespace edit {
 namespace {
 
-void audio_callback(void* userdata, Uint8* stream, int len) {
-    player::fill_buffer((short*) stream, len / 2);
-}
-
 EView m_view;
 void (*m_popup_func)(void);
 
@@ -34,19 +34,31 @@ void set_popup(void (*func)(void)) {
 }
 
 
-bool init() {
-    set_view(VIEW_PROJECT);
+void grow_song(ChunkType type, int id) {
+    Song& song = player::song();
+    if (id <= chunk_count(song, type)) return;
+    // the synth must not see the song half grown
+    audio::lock();
+    ::grow_song(song, type, id);
+    audio::unlock();
+}
+
 
+bool init() {
     init_song(player::song());
 
-    SDL_AudioSpec spec = { MIXRATE, AUDIO_S16, 1, 0, SAMPLES_PER_FRAME, 0, 0, audio_callback };
-    SDL_OpenAudio(&spec, nullptr);
-    SDL_PauseAudio(0);
+    // this also recovers the song from the journal
+    set_view(VIEW_PROJECT);
+    history::reset(player::song());
+
+    audio::init();
     return true;
 }
 
 void free() {
-    SDL_CloseAudio();
+    free_project_view();
+    journal::flush();
+    audio::free();
 }
 
 void draw() {
@@ -112,31 +124,62 @@ void draw() {
         gfx::font(FONT_DEFAULT);
         gfx::font(FONT_MONO);
         bool block_loop = player::block_loop();
-        widths = calculate_column_widths({ -1, -1, -1 });
+        widths = calculate_column_widths({ -1, -1, -1, -1, -1 });
 
-        // loop
+        // undo/redo
+        // a step may grow the song, the synth must not see it half done
+        gfx::font(FONT_DEFAULT);
         gui::min_item_size({ widths[0], BUTTON_BAR });
+        if (gui::button("Undo") && history::can_undo()) {
+            audio::lock();
+            history::undo(player::song());
+            audio::unlock();
+        }
+        gui::same_line();
+        gui::min_item_size({ widths[1], BUTTON_BAR });
+        if (gui::button("Redo") && history::can_redo()) {
+            audio::lock();
+            history::redo(player::song());
+            audio::unlock();
+        }
+        gfx::font(FONT_MONO);
+
+        // loop
+        gui::same_line();
+        gui::min_item_size({ widths[2], BUTTON_BAR });
         if (gui::button("\x13", block_loop)) player::block_loop(!block_loop);
 
         // stop
         gui::same_line();
-        gui::min_item_size({ widths[1], BUTTON_BAR });
+        gui::min_item_size({ widths[3], BUTTON_BAR });
         if (gui::button("\x11")) {
+            audio::lock();
+            audio::flush();
             player::set_playing(false);
             player::reset();
             player::block(get_selected_block());
+            audio::unlock();
         }
 
         // play/pause
         gui::same_line();
-        gui::min_item_size({ widths[2], BUTTON_BAR });
+        gui::min_item_size({ widths[4], BUTTON_BAR });
         if (gui::button("\x10\x12", player::is_playing())) {
+            audio::lock();
+            audio::flush();
             player::set_playing(!player::is_playing());
+            audio::unlock();
+            // the figures in the status line are about the current playback
+            if (player::is_playing()) audio::reset_stats();
         }
 
     }
 
     gfx::present();
+
+    // an edit is complete once the finger is lifted
+    if (input::released()) history::commit(player::song());
+    journal::update(player::song());
 }
 
 
@@ -1,4 +1,5 @@
 #pragma once
+#include "song.hpp"
 
 enum EView {
     VIEW_PROJECT,
@@ -12,6 +13,9 @@ namespace edit {
     void set_view(EView v);
     void set_popup(void (*func)(void));
 
+    // make sure the edited song holds the item with the 1-based id before it is edited
+    void grow_song(ChunkType type, int id);
+
     bool init();
     void draw();
     void free();
@@ -0,0 +1,463 @@
+#include "exporter.hpp"
+#include "player.hpp"
+#include "wav.hpp"
+#include "render_cache.hpp"
+#include <SDL.h>
+#include <sndfile.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+
+namespace exporter {
+namespace {
+
+
+enum {
+    BLOCK_SIZE   = MIXRATE / 2,
+    QUEUE_LENGTH = 8,
+};
+
+// a block shorter than BLOCK_SIZE frames is the last one, an empty block ends the export.
+// it is free again when all sinks are done with it
+struct Block {
+    std::vector<short> samples;
+    int                length;
+    std::atomic<int>   readers;
+};
+
+// uncompressed sinks skip sndfile: the file is mapped and blocks are copied straight into it
+struct Sink {
+    std::string        path;
+    int                channels;
+    SDL_RWops*         file;
+    SNDFILE*           sndfile;
+    wav::Writer        wav;
+    bool               mapped;
+    uint64_t           key;         // in the render cache
+    bool               cached;      // copied from the cache, nothing to render
+    SDL_sem*           full;
+    SDL_Thread*        thread;
+    std::vector<short> master;      // picked out of stem frames
+    std::atomic<int>   samples_written;
+    std::atomic<bool>  failed;
+    Uint64             ticks;
+};
+
+
+sf_count_t get_filelen(void* user_data) {
+    return SDL_RWsize((SDL_RWops*) user_data);
+}
+
+sf_count_t seek(sf_count_t offset, int whence, void* user_data) {
+    int w = whence == SEEK_CUR ? RW_SEEK_CUR
+          : whence == SEEK_SET ? RW_SEEK_SET
+                               : RW_SEEK_END;
+    return SDL_RWseek((SDL_RWops*) user_data, offset, w);
+}
+
+sf_count_t read(void* ptr, sf_count_t count, void* user_data) {
+    return SDL_RWread((SDL_RWops*) user_data, ptr, 1, count);
+}
+
+sf_count_t write(const void* ptr, sf_count_t count, void* user_data) {
+    return SDL_RWwrite((SDL_RWops*) user_data, ptr, 1, count);
+}
+
+sf_count_t tell(void* user_data) {
+    return SDL_RWtell((SDL_RWops*) user_data);
+}
+
+
+std::unique_ptr<Song>              m_song;
+std::unique_ptr<Player>            m_player;
+int                                m_samples;
+int                                m_channels;
+std::vector<std::unique_ptr<Sink>> m_sinks;
+
+std::array<Block, QUEUE_LENGTH>    m_queue;
+SDL_sem*                           m_free;
+SDL_Thread*                        m_synth_thread;
+
+std::atomic<bool>                  m_canceled;
+std::atomic<int>                   m_sinks_done;
+Uint64                             m_start_ticks;
+Uint64                             m_end_ticks;
+Uint64                             m_synth_ticks;
+Stats                              m_stats;
+
+
+double seconds(Uint64 ticks) {
+    return double(ticks) / SDL_GetPerformanceFrequency();
+}
+
+
+bool open_sink(Sink& sink, Song const& song, std::string const& path, Target const& target, int samples) {
+    char str[16] = "";
+    SF_INFO info = { 0, MIXRATE, 1 };
+    switch (target.format) {
+    case OGG:
+        info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+        if (target.quality >= 0) snprintf(str, sizeof(str), "-q%d", int(target.quality * 10 + 0.5f));
+        sink.path = path + str + ".ogg";
+        break;
+    case WAV:
+        sink.mapped = true;
+        sink.path = path + ".wav";
+        break;
+    case FLAC:
+        info.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+        sink.path = path + ".flac";
+        break;
+    case STEMS:
+        sink.mapped   = true;
+        info.channels = Player::STEM_CHANNELS;
+        sink.path = path + "-stems.wav";
+        break;
+    }
+    sink.channels = info.channels;
+
+    char options[32];
+    snprintf(options, sizeof(options), "%d %.3f", target.format, target.quality);
+    sink.key    = render_cache::key(song, options);
+    sink.cached = render_cache::fetch(sink.key, sink.path);
+    if (sink.cached) return true;
+
+    if (sink.mapped) {
+        return sink.wav.open(sink.path, sink.channels, samples, song.title.data(), song.author.data());
+    }
+
+    sink.file = SDL_RWFromFile(sink.path.c_str(), "wb");
+    if (!sink.file) return false;
+
+    SF_VIRTUAL_IO vio = {
+        get_filelen,
+        seek,
+        read,
+        write,
+        tell,
+    };
+
+    sink.sndfile = sf_open_virtual(&vio, SFM_WRITE, &info, sink.file);
+    if (!sink.sndfile) {
+        SDL_RWclose(sink.file);
+        sink.file = nullptr;
+        remove(sink.path.c_str());
+        return false;
+    }
+
+    if (target.format == OGG && target.quality >= 0) {
+        double quality = target.quality;
+        sf_command(sink.sndfile, SFC_SET_VBR_ENCODING_QUALITY, &quality, sizeof(quality));
+    }
+
+    sf_set_string(sink.sndfile, SF_STR_TITLE, song.title.data());
+    sf_set_string(sink.sndfile, SF_STR_ARTIST, song.author.data());
+    return true;
+}
+
+
+void close_sink(Sink& sink) {
+    if (sink.mapped && sink.wav.frames() && !sink.wav.close(sink.samples_written)) sink.failed = true;
+    if (sink.sndfile) sf_close(sink.sndfile);
+    if (sink.file) SDL_RWclose(sink.file);
+    sink.sndfile = nullptr;
+    sink.file    = nullptr;
+}
+
+
+// when a later target fails to open, the files of the earlier ones are dropped.
+// the failed one cleaned up after itself, files copied from the cache are complete and stay
+void discard_sinks(std::vector<std::unique_ptr<Sink>>& sinks) {
+    sinks.pop_back();
+    for (auto& s : sinks) {
+        close_sink(*s);
+        remove(s->path.c_str());
+    }
+    sinks.clear();
+}
+
+
+// keep a complete file for the next export of the same song
+void cache_sink(Sink const& sink, int samples) {
+    if (!sink.failed && sink.samples_written == samples) render_cache::store(sink.key, sink.path);
+}
+
+
+// `samples` are `channels` interleaved, a sink with fewer channels takes the master
+void write_block(Sink& sink, short const* samples, int length, int channels) {
+    Uint64 t   = SDL_GetPerformanceCounter();
+    short* dst = sink.mapped ? sink.wav.frames() + sink.samples_written * sink.channels
+                             : sink.master.data();
+    if (sink.channels < channels) {
+        for (int j = 0; j < length; ++j) dst[j] = samples[j * channels];
+        samples = dst;
+    }
+    else if (sink.mapped) {
+        memcpy(dst, samples, length * channels * sizeof(short));
+    }
+    if (!sink.mapped && sf_writef_short(sink.sndfile, samples, length) != length) {
+        sink.failed = true;
+    }
+    sink.ticks += SDL_GetPerformanceCounter() - t;
+    sink.samples_written += length;
+}
+
+
+int synth_thread_func(void*) {
+    m_player->block_loop(false);
+    m_player->set_playing(true);
+    m_player->reset();
+
+    int samples_left = m_samples;
+    for (int i = 0;; ++i) {
+        SDL_SemWait(m_free);
+        Block& block = m_queue[i % QUEUE_LENGTH];
+        block.length = m_canceled ? 0 : std::min<int>(samples_left, BLOCK_SIZE);
+        if (block.length > 0) {
+            Uint64 t = SDL_GetPerformanceCounter();
+            if (m_channels > 1) m_player->fill_stems(block.samples.data(), block.length);
+            else                m_player->fill_buffer(block.samples.data(), block.length);
+            m_synth_ticks += SDL_GetPerformanceCounter() - t;
+            samples_left -= block.length;
+        }
+        block.readers = m_sinks.size();
+        for (auto& sink : m_sinks) SDL_SemPost(sink->full);
+        if (block.length == 0) break;
+    }
+    return 0;
+}
+
+
+int encode_thread_func(void* user_data) {
+    Sink& sink = *(Sink*) user_data;
+    for (int i = 0;; ++i) {
+        SDL_SemWait(sink.full);
+        Block& block = m_queue[i % QUEUE_LENGTH];
+        if (block.length == 0) break;
+
+        // keep draining after an error, so the synth thread is not stuck on a full queue
+        if (!sink.failed) write_block(sink, block.samples.data(), block.length, m_channels);
+        if (--block.readers == 0) SDL_SemPost(m_free);
+    }
+
+    // closing flushes the encoder, which is part of its cost
+    Uint64 t = SDL_GetPerformanceCounter();
+    close_sink(sink);
+    sink.ticks += SDL_GetPerformanceCounter() - t;
+    cache_sink(sink, m_samples);
+
+    if (++m_sinks_done == (int) m_sinks.size()) {
+        m_end_ticks = SDL_GetPerformanceCounter();
+    }
+    return 0;
+}
+
+
+// a lone mapped sink needs neither queue nor encoder, the synth renders right into the file
+int direct_thread_func(void* user_data) {
+    Sink& sink = *(Sink*) user_data;
+    m_player->block_loop(false);
+    m_player->set_playing(true);
+    m_player->reset();
+
+    while (!m_canceled && sink.samples_written < m_samples) {
+        int    length = std::min<int>(m_samples - sink.samples_written, BLOCK_SIZE);
+        short* dst    = sink.wav.frames() + sink.samples_written * sink.channels;
+        Uint64 t = SDL_GetPerformanceCounter();
+        if (sink.channels > 1) m_player->fill_stems(dst, length);
+        else                   m_player->fill_buffer(dst, length);
+        m_synth_ticks += SDL_GetPerformanceCounter() - t;
+        sink.samples_written += length;
+    }
+
+    Uint64 t = SDL_GetPerformanceCounter();
+    close_sink(sink);
+    sink.ticks += SDL_GetPerformanceCounter() - t;
+    cache_sink(sink, m_samples);
+
+    ++m_sinks_done;
+    m_end_ticks = SDL_GetPerformanceCounter();
+    return 0;
+}
+
+
+} // namespace
+
+
+bool start(Song const& song, std::string const& path, std::vector<Target> const& targets) {
+    m_sinks.clear();
+    m_channels = 1;
+    m_samples  = song_frame_count(song) * SAMPLES_PER_FRAME;
+    for (Target const& target : targets) {
+        m_sinks.emplace_back(new Sink());
+        Sink& sink = *m_sinks.back();
+        if (!open_sink(sink, song, path, target, m_samples)) {
+            discard_sinks(m_sinks);
+            return false;
+        }
+        if (sink.cached) {
+            SDL_Log("export: %s from the cache", sink.path.c_str());
+            m_sinks.pop_back();
+            continue;
+        }
+        m_channels = std::max(m_channels, sink.channels);
+    }
+    if (targets.empty()) return false;
+
+    // the export plays its own copy, the editor may keep playing
+    m_song.reset(new Song(song));
+    m_player.reset(new Player(*m_song));
+
+    m_canceled    = false;
+    m_sinks_done  = 0;
+    m_synth_ticks = 0;
+    m_start_ticks = SDL_GetPerformanceCounter();
+    m_end_ticks   = m_start_ticks;
+    m_stats.cache_hits = targets.size() - m_sinks.size();
+    if (m_sinks.empty()) return true;
+
+    if (m_sinks.size() == 1 && m_sinks[0]->mapped) {
+        Sink& sink = *m_sinks[0];
+        sink.thread = SDL_CreateThread(direct_thread_func, "export synth", &sink);
+        return true;
+    }
+
+    for (Block& block : m_queue) block.samples.resize(BLOCK_SIZE * m_channels);
+    m_free = SDL_CreateSemaphore(QUEUE_LENGTH);
+
+    for (auto& sink : m_sinks) {
+        sink->master.resize(BLOCK_SIZE);
+        sink->full   = SDL_CreateSemaphore(0);
+        sink->thread = SDL_CreateThread(encode_thread_func, "export encoder", sink.get());
+    }
+    m_synth_thread = SDL_CreateThread(synth_thread_func, "export synth", nullptr);
+    return true;
+}
+
+
+void cancel() {
+    m_canceled = true;
+}
+
+
+float progress() {
+    // the slowest encoder
+    int samples = m_samples;
+    for (auto& sink : m_sinks) samples = std::min<int>(samples, sink->samples_written);
+    return m_samples > 0 ? float(samples) / m_samples : 1;
+}
+
+
+bool is_done() {
+    return m_sinks_done == (int) m_sinks.size();
+}
+
+
+bool finish() {
+    if (m_synth_thread) SDL_WaitThread(m_synth_thread, nullptr);
+    m_synth_thread = nullptr;
+    if (m_free) SDL_DestroySemaphore(m_free);
+    m_free = nullptr;
+    for (auto& sink : m_sinks) {
+        SDL_WaitThread(sink->thread, nullptr);
+        if (sink->full) SDL_DestroySemaphore(sink->full);
+    }
+
+    double audio_time = double(m_samples) / MIXRATE;
+    m_stats.samples    = m_samples;
+    m_stats.synth_time = seconds(m_synth_ticks);
+    m_stats.wall_time  = seconds(m_end_ticks - m_start_ticks);
+    m_stats.encode_times.clear();
+    SDL_Log("export: %.1f s of audio in %.2f s, synth %.2f s (%.0fx)",
+            audio_time, m_stats.wall_time,
+            m_stats.synth_time, audio_time / std::max(m_stats.synth_time, 1e-6));
+
+    bool ok = !m_canceled;
+    for (auto& sink : m_sinks) {
+        double t = seconds(sink->ticks);
+        m_stats.encode_times.push_back(t);
+        SDL_Log("export: %s, encoder %.2f s (%.0fx)%s",
+                sink->path.c_str(), t, audio_time / std::max(t, 1e-6), sink->failed ? ", failed" : "");
+        ok &= !sink->failed;
+    }
+    m_sinks.clear();
+    m_player.reset();
+    m_song.reset();
+    return ok;
+}
+
+
+Stats stats() {
+    return m_stats;
+}
+
+
+bool render(Song const& song, std::string const& path, std::vector<Target> const& targets, Stats* stats) {
+    Uint64 start_ticks = SDL_GetPerformanceCounter();
+    int samples  = song_frame_count(song) * SAMPLES_PER_FRAME;
+    int channels = 1;
+    std::vector<std::unique_ptr<Sink>> sinks;
+    for (Target const& target : targets) {
+        sinks.emplace_back(new Sink());
+        Sink& sink = *sinks.back();
+        if (!open_sink(sink, song, path, target, samples)) {
+            discard_sinks(sinks);
+            return false;
+        }
+        if (sink.cached) {
+            sinks.pop_back();
+            continue;
+        }
+        channels = std::max(channels, sink.channels);
+        sink.master.resize(BLOCK_SIZE);
+    }
+    if (targets.empty()) return false;
+
+    Uint64 synth_ticks = 0;
+    if (stats) stats->cache_hits = targets.size() - sinks.size();
+    std::unique_ptr<Player> player(new Player(song));
+    player->block_loop(false);
+    player->set_playing(true);
+    player->reset();
+
+    // a lone mapped sink is rendered into in place
+    bool direct = sinks.size() == 1 && sinks[0]->mapped;
+    std::vector<short> buffer(direct ? 0 : BLOCK_SIZE * channels);
+    for (int pos = 0; !sinks.empty() && pos < samples; pos += BLOCK_SIZE) {
+        int    length = std::min<int>(samples - pos, BLOCK_SIZE);
+        short* dst    = direct ? sinks[0]->wav.frames() + pos * channels : buffer.data();
+        Uint64 t = SDL_GetPerformanceCounter();
+        if (channels > 1) player->fill_stems(dst, length);
+        else              player->fill_buffer(dst, length);
+        synth_ticks += SDL_GetPerformanceCounter() - t;
+        if (direct) sinks[0]->samples_written += length;
+        else for (auto& sink : sinks) {
+            if (!sink->failed) write_block(*sink, dst, length, channels);
+        }
+    }
+
+    bool ok = true;
+    if (stats) stats->encode_times.clear();
+    for (auto& sink : sinks) {
+        Uint64 t = SDL_GetPerformanceCounter();
+        close_sink(*sink);
+        sink->ticks += SDL_GetPerformanceCounter() - t;
+        if (stats) stats->encode_times.push_back(seconds(sink->ticks));
+        cache_sink(*sink, samples);
+        ok &= !sink->failed;
+    }
+    if (stats) {
+        stats->samples    = samples;
+        stats->synth_time = seconds(synth_ticks);
+        stats->wall_time  = seconds(SDL_GetPerformanceCounter() - start_ticks);
+    }
+    return ok;
+}
+
+
+} // namespace
@@ -0,0 +1,45 @@
+#pragma once
+#include "song.hpp"
+#include <string>
+#include <vector>
+
+
+// renders a copy of the song to sound files in the background.
+// one thread runs the synth and hands large blocks through a bounded queue
+// to one encoder thread per target, so the song is rendered once
+// and each added target only costs its encoding
+namespace exporter {
+    // STEMS is a multichannel WAV of the master, then each voice before and after the filter,
+    // see Player::fill_stems
+    enum Format { OGG, WAV, FLAC, STEMS };
+
+    struct Target {
+        Format format;
+        float  quality = -1;   // 0 to 1 for OGG, negative for the encoder default
+    };
+
+    struct Stats {
+        int                 samples;
+        double              synth_time;     // seconds spent in the synth
+        std::vector<double> encode_times;   // seconds spent in each encoder that ran
+        double              wall_time;
+        int                 cache_hits;     // targets copied from the render cache
+    };
+
+    // `path` is without suffix, each target adds its own.
+    // returns false if a file could not be opened
+    bool start(Song const& song, std::string const& path, std::vector<Target> const& targets);
+    void cancel();
+
+    float progress();
+    bool  is_done();
+
+    // join the threads after is_done(). returns false if the export was canceled or failed
+    bool  finish();
+    Stats stats();
+
+    // the same export on the calling thread, without touching the background one.
+    // each call uses its own player, so separate threads can render separate songs
+    bool  render(Song const& song, std::string const& path, std::vector<Target> const& targets,
+                 Stats* stats = nullptr);
+}
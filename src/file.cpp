@@ -0,0 +1,109 @@
+#include "file.hpp"
+#include <SDL.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace file {
+
+
+bool read(std::string const& path, std::vector<uint8_t>& data) {
+    SDL_RWops* file = SDL_RWFromFile(path.c_str(), "rb");
+    if (!file) return false;
+    data.resize(std::max<Sint64>(SDL_RWsize(file), 0));
+    size_t len = SDL_RWread(file, data.data(), 1, data.size());
+    SDL_RWclose(file);
+    return len == data.size();
+}
+
+
+namespace {
+
+
+bool write_all(int fd, void const* data, size_t size) {
+    uint8_t const* p = (uint8_t const*) data;
+    while (size > 0) {
+        ssize_t len = write(fd, p, size);
+        if (len < 0) return false;
+        p    += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+// sync and close the temporary file and rename it over `path`
+bool commit(int fd, std::string const& tmp_path, std::string const& path) {
+    bool ok = fsync(fd) == 0;
+    ok &= close(fd) == 0;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // make the rename itself durable
+    std::string dir = path.substr(0, path.find_last_of('/') + 1);
+    int dir_fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return true;
+}
+
+
+} // namespace
+
+
+bool write_atomic(std::string const& path, void const* data, size_t size) {
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    if (!write_all(fd, data, size)) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return commit(fd, tmp_path, path);
+}
+
+
+bool copy_atomic(std::string const& src, std::string const& dst) {
+    int src_fd = open(src.c_str(), O_RDONLY);
+    if (src_fd < 0) return false;
+    std::string tmp_path = dst + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        close(src_fd);
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(1 << 16);
+    for (;;) {
+        ssize_t len = ::read(src_fd, buffer.data(), buffer.size());
+        if (len == 0) break;
+        if (len < 0 || !write_all(fd, buffer.data(), len)) {
+            close(src_fd);
+            close(fd);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+    }
+    close(src_fd);
+    return commit(fd, tmp_path, dst);
+}
+
+
+uint64_t hash(void const* data, size_t size) {
+    uint8_t const* p = (uint8_t const*) data;
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+
+} // namespace
@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+namespace file {
+    bool read(std::string const& path, std::vector<uint8_t>& data);
+
+    // write to a temporary file next to `path`, sync it and rename it over `path`,
+    // so `path` either keeps its old content or gets the complete new one
+    bool write_atomic(std::string const& path, void const* data, size_t size);
+    // the same for a copy of the file `src`
+    bool copy_atomic(std::string const& src, std::string const& dst);
+
+    // 64 bit FNV-1a, for telling file contents apart
+    uint64_t hash(void const* data, size_t size);
+}
@@ -0,0 +1,106 @@
+#include "../song.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+
+// libFuzzer entry for the song loader. whatever load_song accepts must hold
+// the invariants normalize_song promises, the player relies on them
+
+
+namespace {
+
+
+#define CHECK(c) do { if (!(c)) { fprintf(stderr, "check failed: %s\n", #c); abort(); } } while (0)
+
+
+bool is_terminated(char const* s, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (s[i] == '\0') return true;
+    }
+    return false;
+}
+
+
+void check_filter(Filter const& filter) {
+    CHECK(filter.routing < (1 << CHANNEL_COUNT));
+    CHECK(filter.length <= MAX_FILTER_LENGTH);
+    CHECK(filter.loop <= std::max(0, filter.length - 1));
+    for (int i = 0; i < filter.length; ++i) {
+        Filter::Row const& row = filter.rows[i];
+        CHECK((row.type & ~(FILTER_LOW | FILTER_BAND | FILTER_HIGH)) == 0);
+        CHECK(row.resonance <= 15);
+        CHECK(row.operation <= Filter::OP_DEC);
+        CHECK(row.value <= 31);
+    }
+}
+
+
+void check_song(Song const& song) {
+    CHECK(is_terminated(song.title.data(), song.title.size()));
+    CHECK(is_terminated(song.author.data(), song.author.size()));
+    CHECK(song.tempo >= 4 && song.tempo <= 16);
+    CHECK(song.swing <= 8);
+    CHECK(song.track_length >= 1 && song.track_length <= MAX_TRACK_LENGTH);
+    CHECK(song.table_length >= 1 && song.table_length <= MAX_SONG_LENGTH);
+    CHECK((int) song.table.size() == song.table_length);
+
+    CHECK(song.tracks.size() <= TRACK_COUNT);
+    CHECK(song.instruments.size() <= INSTRUMENT_COUNT);
+    CHECK(song.effects.size() <= EFFECT_COUNT);
+
+    for (Song::Block const& block : song.table) {
+        for (uint8_t t : block) CHECK(t <= TRACK_COUNT);
+    }
+    for (Track const& track : song.tracks) {
+        for (Track::Row const& row : track.rows) {
+            CHECK(row.instrument <= INSTRUMENT_COUNT);
+            CHECK(row.effect <= EFFECT_COUNT);
+            CHECK(row.note <= 96 || row.note == 255);
+        }
+    }
+    for (Instrument const& inst : song.instruments) {
+        CHECK(is_terminated(inst.name.data(), inst.name.size()));
+        for (uint8_t v : inst.adsr) CHECK(v <= 15);
+        CHECK(inst.hard_restart <= 1);
+        CHECK(inst.length <= MAX_INSTRUMENT_LENGTH);
+        CHECK(inst.loop <= std::max(0, inst.length - 1));
+        for (int i = 0; i < inst.length; ++i) {
+            CHECK(inst.rows[i].operation <= Instrument::OP_SET);
+            CHECK(inst.rows[i].value <= 31);
+        }
+        check_filter(inst.filter);
+    }
+    for (Effect const& effect : song.effects) {
+        CHECK(is_terminated(effect.name.data(), effect.name.size()));
+        CHECK(effect.length <= MAX_EFFECT_LENGTH);
+        CHECK(effect.loop <= std::max(0, effect.length - 1));
+        for (int i = 0; i < effect.length; ++i) {
+            Effect::Row const& row = effect.rows[i];
+            CHECK(row.operation <= Effect::OP_DETUNE);
+            if (row.operation == Effect::OP_ABSOLUTE) CHECK(row.value <= 96);
+            else                                      CHECK(row.value >= 0x30 - 24 && row.value <= 0x30 + 24);
+        }
+    }
+}
+
+
+} // namespace
+
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size) {
+    static std::unique_ptr<Song> song(new Song());
+    if (!load_song(*song, data, size)) return 0;
+    check_song(*song);
+
+    // a normalized song survives saving and loading unchanged
+    std::vector<uint8_t> saved;
+    save_song(*song, saved);
+    CHECK(load_song(*song, saved.data(), saved.size()));
+    std::vector<uint8_t> again;
+    save_song(*song, again);
+    CHECK(saved == again);
+    return 0;
+}
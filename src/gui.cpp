@@ -239,6 +239,26 @@ bool button(char const* label, bool active, bool is_tab) {
 }
 
 
+bool waveform(uint8_t const* levels, int count, bool active) {
+    Box box = item_box({ count, 0 });
+    bool clicked = m_active_item == nullptr && box_touched(box) && input::just_released();
+
+    gfx::color(color::drag);
+    gfx::rectangle(box.pos, box.size, 0);
+    if (!levels) return clicked;
+
+    // one bar per level, centered vertically
+    gfx::color(active ? color::handle_active : color::handle_normal);
+    for (int i = 0; i < count; ++i) {
+        int x1 = box.pos.x + i * box.size.x / count;
+        int x2 = box.pos.x + (i + 1) * box.size.x / count;
+        int h  = std::max(1, levels[i] * box.size.y / 255);
+        gfx::rectangle({ x1, box.pos.y + (box.size.y - h) / 2 }, { x2 - x1, h }, 0);
+    }
+    return clicked;
+}
+
+
 bool hold() {
     if (m_hold) m_active_item = (void const*) -1;
     return m_hold;
@@ -48,6 +48,7 @@ namespace gui {
     bool drag_int(char const* label, char const* fmt, int& value, int min, int max, int page = 1);
     bool vertical_drag_int(int& value, int min, int max, int page = 1);
     bool clavier(uint8_t& n, int offset, bool highlight);
+    bool waveform(uint8_t const* levels, int count, bool active);
 
     template<class T>
     bool drag_int(char const* label, char const* fmt, T& value, int min, int max, int page = 1) {
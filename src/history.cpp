@@ -0,0 +1,145 @@
+#include "history.hpp"
+#include "file.hpp"
+#include "usage.hpp"
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <cstring>
+
+
+namespace history {
+namespace {
+
+
+enum {
+    MAX_STEPS      = 4096,
+    PURGE_INTERVAL = 256,
+};
+
+
+using Chunk = std::shared_ptr<std::vector<uint8_t> const>;
+
+struct Change {
+    ChunkType type;
+    int       index;
+    Chunk     before;
+    Chunk     after;
+};
+
+using Step = std::vector<Change>;
+
+
+// chunks of the current version
+std::array<std::vector<Chunk>, CHUNK_TYPE_COUNT> m_chunks;
+std::deque<Step>                                 m_steps;
+size_t                                           m_pos;
+
+// all live chunk bodies by content hash, so identical chunks share one body,
+// e.g. a track and its pasted copies
+std::unordered_multimap<uint64_t, std::weak_ptr<std::vector<uint8_t> const>> m_bodies;
+int                                                                        m_inserts;
+
+
+Chunk make_chunk(uint8_t const* data, int size) {
+    uint64_t h = file::hash(data, size);
+    auto range = m_bodies.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        Chunk c = it->second.lock();
+        if (c && (int) c->size() == size && memcmp(c->data(), data, size) == 0) return c;
+    }
+
+    // forget bodies that are no longer used every now and then
+    if (++m_inserts % PURGE_INTERVAL == 0) {
+        for (auto it = m_bodies.begin(); it != m_bodies.end();) {
+            if (it->second.expired()) it = m_bodies.erase(it);
+            else ++it;
+        }
+    }
+
+    Chunk c = std::make_shared<std::vector<uint8_t> const>(data, data + size);
+    m_bodies.emplace(h, c);
+    return c;
+}
+
+
+void apply(Song& song, Step const& step, bool forward) {
+    for (Change const& c : step) {
+        Chunk const& chunk = forward ? c.after : c.before;
+        grow_song(song, c.type, c.index + 1);
+        memcpy(chunk_data(song, c.type, c.index), chunk->data(), chunk->size());
+        m_chunks[c.type][c.index] = chunk;
+        usage::update(song, c.type, c.index);
+    }
+}
+
+
+} // namespace
+
+
+void reset(Song const& song) {
+    m_steps.clear();
+    m_pos = 0;
+    usage::reset(song);
+
+    for (int t = 0; t < CHUNK_TYPE_COUNT; ++t) {
+        ChunkType type = ChunkType(t);
+        int size = chunk_size(type);
+
+        std::vector<Chunk>& chunks = m_chunks[t];
+        chunks.resize(chunk_count(song, type));
+        for (int i = 0; i < (int) chunks.size(); ++i) {
+            chunks[i] = make_chunk(chunk_data(song, type, i), size);
+        }
+    }
+}
+
+
+void commit(Song const& song) {
+    Step step;
+    for (int t = 0; t < CHUNK_TYPE_COUNT; ++t) {
+        ChunkType type = ChunkType(t);
+        int size = chunk_size(type);
+        std::vector<Chunk>& chunks = m_chunks[t];
+        // items the song grew by were empty before
+        int count = chunk_count(song, type);
+        if ((int) chunks.size() < count) chunks.resize(count, make_chunk(chunk_data(song, type, count), size));
+        for (int i = 0; i < (int) chunks.size(); ++i) {
+            uint8_t const* data = chunk_data(song, type, i);
+            if (memcmp(data, chunks[i]->data(), size) == 0) continue;
+            Chunk after = make_chunk(data, size);
+            step.push_back({ type, i, chunks[i], after });
+            chunks[i] = after;
+            usage::update(song, type, i);
+        }
+    }
+    if (step.empty()) return;
+
+    // a new step drops everything that could have been redone
+    m_steps.resize(m_pos);
+    m_steps.push_back(std::move(step));
+    if (m_steps.size() > MAX_STEPS) m_steps.pop_front();
+    m_pos = m_steps.size();
+}
+
+
+bool can_undo() { return m_pos > 0; }
+bool can_redo() { return m_pos < m_steps.size(); }
+
+
+bool undo(Song& song) {
+    commit(song);
+    if (!can_undo()) return false;
+    apply(song, m_steps[--m_pos], false);
+    return true;
+}
+
+
+bool redo(Song& song) {
+    commit(song);
+    if (!can_redo()) return false;
+    apply(song, m_steps[m_pos++], true);
+    return true;
+}
+
+
+} // namespace
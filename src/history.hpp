@@ -0,0 +1,18 @@
+#pragma once
+#include "song.hpp"
+
+
+// undo/redo. versions of the song share all chunks that did not change,
+// and identical chunks share one body, so a step only costs the new data it introduced.
+namespace history {
+    // forget all steps, e.g. after a song was loaded
+    void reset(Song const& song);
+
+    // record whatever changed since the last call as one step
+    void commit(Song const& song);
+
+    bool can_undo();
+    bool can_redo();
+    bool undo(Song& song);
+    bool redo(Song& song);
+}
@@ -2,6 +2,7 @@
 #include "gui.hpp"
 #include "player.hpp"
 #include "edit.hpp"
+#include "usage.hpp"
 
 
 namespace {
@@ -24,7 +25,8 @@ void draw_instrument_select() {
     for (int y = 0; y < INSTRUMENT_COUNT / 2; ++y) {
         for (int x = 0; x < 2; ++x) {
             int nr = y + x * (INSTRUMENT_COUNT / 2) + 1;
-            Instrument const& inst = song.instruments[nr - 1];
+            static Instrument const empty = {};
+            Instrument const& inst = nr <= (int) song.instruments.size() ? song.instruments[nr - 1] : empty;
 
             Vec c1 = gui::cursor();
             gui::min_item_size({ widths[x], BUTTON_SMALL });
@@ -46,7 +48,9 @@ void draw_instrument_select() {
             gui::same_line();
             gui::min_item_size({ widths[x] - BUTTON_SMALL - gui::PADDING, BUTTON_SMALL });
             gui::align(gui::LEFT);
-            gui::text(inst.name.data());
+            // instruments no block plays are in parentheses
+            if (inst.length > 0 && usage::instrument_blocks(nr).none()) gui::text("(%s)", inst.name.data());
+            else gui::text(inst.name.data());
             gui::align(gui::CENTER);
             gui::same_line();
             gui::cursor(c2);
@@ -69,7 +73,8 @@ void draw_effect_select() {
     for (int y = 0; y < EFFECT_COUNT / 2; ++y) {
         for (int x = 0; x < 2; ++x) {
             int nr = y + x * (EFFECT_COUNT / 2) + 1;
-            Effect const& effect = song.effects[nr - 1];
+            static Effect const empty = {};
+            Effect const& effect = nr <= (int) song.effects.size() ? song.effects[nr - 1] : empty;
 
             Vec c1 = gui::cursor();
             gui::min_item_size({ widths[x], BUTTON_SMALL });
@@ -91,7 +96,8 @@ void draw_effect_select() {
             gui::same_line();
             gui::min_item_size({ widths[x] - BUTTON_SMALL - gui::PADDING, BUTTON_SMALL });
             gui::align(gui::LEFT);
-            gui::text(effect.name.data());
+            if (effect.length > 0 && usage::effect_blocks(nr).none()) gui::text("(%s)", effect.name.data());
+            else gui::text(effect.name.data());
             gui::align(gui::CENTER);
             gui::same_line();
             gui::cursor(c2);
@@ -125,6 +131,7 @@ void draw_instrument_view() {
     gui::separator();
 
     Song& song = player::song();
+    edit::grow_song(CHUNK_INSTRUMENT, selected_instrument());
     Instrument& inst = song.instruments[selected_instrument() - 1];
 
     // name
@@ -348,6 +355,7 @@ void draw_effect_view() {
 
 
     Song& song = player::song();
+    edit::grow_song(CHUNK_EFFECT, selected_effect());
     Effect& effect = song.effects[selected_effect() - 1];
 
     // name
@@ -1,6 +1,7 @@
 #include "gui.hpp"
 #include "track_view.hpp"
 #include "player.hpp"
+#include "audio.hpp"
 #include "input.hpp"
 
 
@@ -64,7 +65,10 @@ void draw_jam_view() {
     if (m_jam_touch && m_jam_touch->state == input::Touch::JUST_RELEASED) {
         m_jam_touch = nullptr;
         m_jam_note = 0;
-        player::jam({ 0, 0, 255 });
+        audio::lock();
+        audio::flush();
+        player::jam({ 0, 0, 255 }, audio::jam_time());
+        audio::unlock();
     }
     else if (m_jam_note && m_jam_note != prev_note) {
         Track::Row row = { 0, 0, m_jam_note };
@@ -72,7 +76,10 @@ void draw_jam_view() {
             row.instrument = selected_instrument();
             row.effect     = selected_effect();
         }
-        player::jam(row);
+        audio::lock();
+        audio::flush();
+        player::jam(row, audio::jam_time());
+        audio::unlock();
     }
 
     gui::separator();
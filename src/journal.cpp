@@ -0,0 +1,178 @@
+#include "journal.hpp"
+#include "file.hpp"
+#include <SDL.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory>
+#include <algorithm>
+
+
+namespace journal {
+namespace {
+
+
+// file format:
+//
+//   magic "FSJ1", u16 length, base path
+//   records: u8 chunk type, u16 chunk index, u16 offset, u16 length, data
+//
+// numbers are little-endian. chunk data is in host layout,
+// the journal never leaves the device.
+
+constexpr char MAGIC[]      = "FSJ1";
+constexpr int  MAGIC_LENGTH = sizeof(MAGIC) - 1;
+enum {
+    RECORD_HEADER_SIZE = 7,
+    FLUSH_INTERVAL     = 1000,
+    FLUSH_SIZE         = 4096,
+};
+
+
+std::string           m_path;
+int                   m_fd = -1;
+std::unique_ptr<Song> m_shadow;
+std::vector<uint8_t>  m_pending;
+Uint32                m_flush_time;
+bool                  m_failed;
+
+
+void put_u16(std::vector<uint8_t>& data, uint16_t v) {
+    data.push_back(v);
+    data.push_back(v >> 8);
+}
+
+uint16_t get_u16(uint8_t const* p) {
+    return p[0] | p[1] << 8;
+}
+
+
+bool replay(std::vector<uint8_t> const& data, Song& base_song, Song& song, std::string& base) {
+    if (data.size() < MAGIC_LENGTH + 2 || memcmp(data.data(), MAGIC, MAGIC_LENGTH) != 0) return false;
+    size_t pos = MAGIC_LENGTH;
+    size_t len = get_u16(&data[pos]);
+    pos += 2;
+    if (pos + len > data.size()) return false;
+    base.assign((char const*) &data[pos], len);
+    pos += len;
+
+    if (base.empty()) init_song(base_song);
+    else if (!load_song(base_song, base.c_str())) return false;
+    song = base_song;
+
+    // stop at the first broken record, it was cut off by a crash
+    while (pos + RECORD_HEADER_SIZE <= data.size()) {
+        uint8_t const* r = &data[pos];
+        ChunkType type   = ChunkType(r[0]);
+        int       index  = get_u16(r + 1);
+        int       offset = get_u16(r + 3);
+        int       length = get_u16(r + 5);
+        pos += RECORD_HEADER_SIZE;
+        if (type >= CHUNK_TYPE_COUNT || index >= chunk_max_count(type) ||
+            offset + length > chunk_size(type) || pos + length > data.size()) break;
+        grow_song(song, type, index + 1);
+        memcpy(chunk_data(song, type, index) + offset, &data[pos], length);
+        pos += length;
+    }
+
+    normalize_song(song);
+    return true;
+}
+
+
+} // namespace
+
+
+bool init(std::string const& path, Song& song, std::string& base) {
+    m_path = path;
+    m_shadow.reset(new Song());
+
+    std::vector<uint8_t> data;
+    std::unique_ptr<Song> base_song(new Song());
+    if (!file::read(m_path, data) || !replay(data, *base_song, song, base)) {
+        base.clear();
+        reset(base, song);
+        return false;
+    }
+
+    // rewrite the journal compacted, which also drops a record that was cut off
+    reset(base, *base_song);
+    update(song);
+    flush();
+    return true;
+}
+
+
+void reset(std::string const& base, Song const& song) {
+    if (m_path.empty()) return;
+    if (m_fd >= 0) close(m_fd);
+    m_pending.clear();
+    m_failed = false;
+
+    std::vector<uint8_t> header(MAGIC, MAGIC + MAGIC_LENGTH);
+    put_u16(header, base.size());
+    header.insert(header.end(), base.begin(), base.end());
+    file::write_atomic(m_path, header.data(), header.size());
+
+    *m_shadow = song;
+    m_fd = open(m_path.c_str(), O_WRONLY | O_APPEND);
+    m_flush_time = SDL_GetTicks();
+}
+
+
+void update(Song const& song) {
+    if (m_fd < 0) return;
+
+    for (int t = 0; t < CHUNK_TYPE_COUNT; ++t) {
+        ChunkType type = ChunkType(t);
+        int size = chunk_size(type);
+        // chunks the song dropped compare as zeros
+        int count = std::max(chunk_count(song, type), chunk_count(*m_shadow, type));
+        grow_song(*m_shadow, type, count);
+        for (int i = 0; i < count; ++i) {
+            uint8_t const* a = chunk_data(song, type, i);
+            uint8_t*       b = chunk_data(*m_shadow, type, i);
+            if (memcmp(a, b, size) == 0) continue;
+
+            // one record covering the changed bytes
+            int first = 0;
+            int last  = size - 1;
+            while (a[first] == b[first]) ++first;
+            while (a[last] == b[last]) --last;
+            int length = last - first + 1;
+
+            m_pending.push_back(type);
+            put_u16(m_pending, i);
+            put_u16(m_pending, first);
+            put_u16(m_pending, length);
+            m_pending.insert(m_pending.end(), a + first, a + first + length);
+            memcpy(b + first, a + first, length);
+        }
+    }
+
+    if (m_pending.size() > FLUSH_SIZE ||
+        (!m_pending.empty() && SDL_GetTicks() - m_flush_time > FLUSH_INTERVAL)) flush();
+}
+
+
+void flush() {
+    m_flush_time = SDL_GetTicks();
+    if (m_fd < 0 || m_pending.empty()) return;
+
+    // what could not be written stays pending for the next flush
+    size_t done = 0;
+    while (done < m_pending.size()) {
+        ssize_t len = write(m_fd, m_pending.data() + done, m_pending.size() - done);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        done += len;
+    }
+    m_pending.erase(m_pending.begin(), m_pending.begin() + done);
+    m_failed = !m_pending.empty() || fsync(m_fd) != 0;
+}
+
+
+bool failed() { return m_failed; }
+
+
+} // namespace
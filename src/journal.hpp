@@ -0,0 +1,22 @@
+#pragma once
+#include "song.hpp"
+#include <string>
+
+
+// append-only log of song edits, so unsaved changes survive the app being killed
+namespace journal {
+    // replay an existing journal on top of its base song.
+    // returns false if there was nothing to recover.
+    // `base` is the path of the song the journal refers to, empty for a new song.
+    bool init(std::string const& path, Song& song, std::string& base);
+
+    // start over after the song was loaded, saved or reset
+    void reset(std::string const& base, Song const& song);
+
+    // record whatever changed since the last call; writes happen in batches
+    void update(Song const& song);
+    void flush();
+
+    // the last flush could not write everything. the rest is kept and tried again
+    bool failed();
+}
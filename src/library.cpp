@@ -0,0 +1,289 @@
+#include "library.hpp"
+#include "song.hpp"
+#include "player.hpp"
+#include "file.hpp"
+#include "pack.hpp"
+#include <SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <iterator>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+#define FILE_SUFFIX ".sng"
+
+
+namespace library {
+namespace {
+
+
+// index file format:
+//
+//   magic "FSLI", u16 version, u32 entry count
+//   entries: name, title, author, u32 duration, u64 mtime in ns, u64 size, u64 hash
+//
+// strings are a u16 length followed by the bytes, numbers are little-endian.
+
+constexpr char MAGIC[]      = "FSLI";
+constexpr int  MAGIC_LENGTH = sizeof(MAGIC) - 1;
+enum { VERSION = 2 };
+
+
+std::string        m_songs_dir;
+std::string        m_index_path;
+SDL_Thread*        m_thread;
+SDL_sem*           m_sem;
+std::atomic<bool>  m_running;
+
+// shared with the UI thread
+SDL_mutex*         m_mutex;
+std::vector<Entry> m_entries;
+bool               m_changed;
+
+
+void put(std::vector<uint8_t>& data, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) data.push_back(v >> i * 8);
+}
+
+void put(std::vector<uint8_t>& data, std::string const& s) {
+    put(data, s.size(), 2);
+    data.insert(data.end(), s.begin(), s.end());
+}
+
+
+// a save within the same second as the last scan must still count as a change
+int64_t mtime(struct stat const& st) {
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+
+struct Reader {
+    uint8_t const* pos;
+    uint8_t const* end;
+    bool           ok = true;
+
+    uint64_t get(int bytes) {
+        if (end - pos < bytes) {
+            ok = false;
+            return 0;
+        }
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= uint64_t(*pos++) << i * 8;
+        return v;
+    }
+    std::string str() {
+        size_t len = get(2);
+        if (!ok || size_t(end - pos) < len) {
+            ok = false;
+            return {};
+        }
+        pos += len;
+        return std::string((char const*) pos - len, len);
+    }
+};
+
+
+bool load_index(std::vector<Entry>& entries) {
+    std::vector<uint8_t> data;
+    if (!file::read(m_index_path, data)) return false;
+    if (data.size() < MAGIC_LENGTH || memcmp(data.data(), MAGIC, MAGIC_LENGTH) != 0) return false;
+    Reader r = { data.data() + MAGIC_LENGTH, data.data() + data.size() };
+    if (r.get(2) != VERSION) return false;
+    size_t count = r.get(4);
+    for (size_t i = 0; i < count && r.ok; ++i) {
+        Entry e;
+        e.name     = r.str();
+        e.title    = r.str();
+        e.author   = r.str();
+        e.duration = r.get(4);
+        e.mtime    = r.get(8);
+        e.size     = r.get(8);
+        e.hash     = r.get(8);
+        entries.push_back(std::move(e));
+    }
+    return r.ok;
+}
+
+
+void save_index(std::vector<Entry> const& entries) {
+    std::vector<uint8_t> data(MAGIC, MAGIC + MAGIC_LENGTH);
+    put(data, VERSION, 2);
+    put(data, entries.size(), 4);
+    for (Entry const& e : entries) {
+        put(data, e.name);
+        put(data, e.title);
+        put(data, e.author);
+        put(data, e.duration, 4);
+        put(data, e.mtime, 8);
+        put(data, e.size, 8);
+        put(data, e.hash, 8);
+    }
+    file::write_atomic(m_index_path, data.data(), data.size());
+}
+
+
+bool read_entry(Entry& e) {
+    std::vector<uint8_t> data;
+    if (!file::read(m_songs_dir + e.name + FILE_SUFFIX, data)) return false;
+    std::unique_ptr<Song> song(new Song());
+    if (!load_song(*song, data.data(), data.size())) return false;
+    e.title    = song->title.data();
+    e.author   = song->author.data();
+    e.duration = song_frame_count(*song) / FRAMES_PER_SECOND;
+    e.hash     = file::hash(data.data(), data.size());
+    return true;
+}
+
+
+// list all songs of a pack; the index has everything but the meta data
+void read_pack(std::string const& pack_name, struct stat const& st, std::vector<Entry>& entries) {
+    pack::Pack p;
+    if (!p.open(m_songs_dir + pack_name + PACK_SUFFIX)) return;
+    std::unique_ptr<Song> song(new Song());
+    for (int i = 0; i < p.count(); ++i) {
+        pack::Entry const& pe = p.entry(i);
+        Entry e = {};
+        e.name  = pack_name + "/" + pe.name;
+        e.title = pe.title;
+        e.mtime = mtime(st);
+        e.size  = st.st_size;
+        e.hash  = pe.hash;
+        if (load_song(*song, p.data(pe), pe.length)) {
+            e.author   = song->author.data();
+            e.duration = song_frame_count(*song) / FRAMES_PER_SECOND;
+        }
+        entries.push_back(std::move(e));
+    }
+}
+
+
+void publish(std::vector<Entry> const& entries) {
+    SDL_LockMutex(m_mutex);
+    m_entries = entries;
+    m_changed = true;
+    SDL_UnlockMutex(m_mutex);
+}
+
+
+// reuse entries whose file has the same mtime and size, read all others.
+// reused entries are copied, `old` must stay sorted for the lookups
+bool scan(std::vector<Entry>& entries) {
+    DIR* dir = opendir(m_songs_dir.c_str());
+    if (!dir) return false;
+
+    std::vector<Entry> old;
+    old.swap(entries);
+    bool changed = false;
+
+    while (struct dirent* ent = readdir(dir)) {
+        if (ent->d_type != DT_REG) continue;
+        std::string name = ent->d_name;
+        if (name.size() <= 4) continue;
+        std::string suffix = name.substr(name.size() - 4);
+        if (suffix != FILE_SUFFIX && suffix != PACK_SUFFIX) continue;
+
+        struct stat st;
+        if (stat((m_songs_dir + name).c_str(), &st) == -1) continue;
+
+        if (suffix == PACK_SUFFIX) {
+            // a pack is reused or reread as a whole
+            std::string prefix = name.substr(0, name.size() - 4) + "/";
+            auto first = std::lower_bound(old.begin(), old.end(), prefix, [](Entry const& a, std::string const& b) {
+                return a.name < b;
+            });
+            auto last = first;
+            while (last != old.end() && last->name.compare(0, prefix.size(), prefix) == 0) ++last;
+            if (first != last && first->mtime == mtime(st) && first->size == st.st_size) {
+                std::copy(first, last, std::back_inserter(entries));
+                continue;
+            }
+            read_pack(name.substr(0, name.size() - 4), st, entries);
+            changed = true;
+            continue;
+        }
+
+        Entry e = {};
+        e.name  = name.substr(0, name.size() - 4);
+        e.mtime = mtime(st);
+        e.size  = st.st_size;
+
+        auto it = std::lower_bound(old.begin(), old.end(), e, [](Entry const& a, Entry const& b) {
+            return a.name < b.name;
+        });
+        if (it != old.end() && it->name == e.name && it->mtime == e.mtime && it->size == e.size) {
+            entries.push_back(*it);
+            continue;
+        }
+        // broken songs are listed without meta data
+        read_entry(e);
+        entries.push_back(std::move(e));
+        changed = true;
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) {
+        return a.name < b.name;
+    });
+    return changed || entries.size() != old.size();
+}
+
+
+int thread_func(void*) {
+    std::vector<Entry> entries;
+    load_index(entries);
+    publish(entries);
+
+    while (SDL_SemWait(m_sem) == 0 && m_running) {
+        // collapse queued requests into one scan
+        while (SDL_SemTryWait(m_sem) == 0) {}
+        if (!scan(entries)) continue;
+        publish(entries);
+        save_index(entries);
+    }
+    return 0;
+}
+
+
+} // namespace
+
+
+void init(std::string const& songs_dir, std::string const& index_path) {
+    m_songs_dir  = songs_dir;
+    m_index_path = index_path;
+    m_mutex      = SDL_CreateMutex();
+    m_sem        = SDL_CreateSemaphore(0);
+    m_running    = true;
+    m_thread     = SDL_CreateThread(thread_func, "library", nullptr);
+}
+
+
+void free() {
+    if (!m_thread) return;
+    m_running = false;
+    SDL_SemPost(m_sem);
+    SDL_WaitThread(m_thread, nullptr);
+    m_thread = nullptr;
+    SDL_DestroySemaphore(m_sem);
+    SDL_DestroyMutex(m_mutex);
+}
+
+
+void refresh() {
+    if (m_sem) SDL_SemPost(m_sem);
+}
+
+
+bool poll(std::vector<Entry>& entries) {
+    if (!m_mutex) return false;
+    SDL_LockMutex(m_mutex);
+    bool changed = m_changed;
+    if (changed) entries = m_entries;
+    m_changed = false;
+    SDL_UnlockMutex(m_mutex);
+    return changed;
+}
+
+
+} // namespace
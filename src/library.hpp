@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+// index of the songs directory with the song meta data,
+// persisted and refreshed in the background so the file list shows up instantly
+namespace library {
+    struct Entry {
+        std::string name;       // file name without suffix, "pack/song" for songs in a pack
+        std::string title;
+        std::string author;
+        int         duration;   // seconds
+        int64_t     mtime;      // of the file, or the pack, in nanoseconds
+        int64_t     size;
+        uint64_t    hash;       // of the file content
+    };
+
+    void init(std::string const& songs_dir, std::string const& index_path);
+    void free();
+
+    // rescan the songs directory in the background; only changed files are read
+    void refresh();
+
+    // copy the entries, sorted by name, if they changed since the last call
+    bool poll(std::vector<Entry>& entries);
+}
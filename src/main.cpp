@@ -1,4 +1,5 @@
 #include "edit.hpp"
+#include "journal.hpp"
 #include "input.hpp"
 #include "gui.hpp"
 #include <cstdio>
@@ -24,6 +25,11 @@ int main(int argc, char** args) {
                 running = false;
                 break;
 
+            case SDL_APP_WILLENTERBACKGROUND:
+                // we might not come back
+                journal::flush();
+                break;
+
             case SDL_KEYDOWN:
                 if (e.key.keysym.scancode == SDL_SCANCODE_ESCAPE) running = false;
                 break;
@@ -0,0 +1,233 @@
+#include "pack.hpp"
+#include "song.hpp"
+#include "file.hpp"
+#include <SDL.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+namespace pack {
+namespace {
+
+
+// file format:
+//
+//   magic "FSPK", u16 version, u16 reserved, u32 entry count, u32 reserved
+//   index: entries sorted by name
+//   song data
+//
+// numbers are little-endian. the index is read in place, which assumes a
+// little-endian host like all platforms we run on.
+
+constexpr char MAGIC[]      = "FSPK";
+constexpr int  MAGIC_LENGTH = sizeof(MAGIC) - 1;
+enum {
+    VERSION     = 1,
+    HEADER_SIZE = 16,
+};
+
+static_assert(sizeof(Entry) == 88, "");
+
+enum { OPEN_PACKS = 4 };
+
+
+// names become file names on unpack and the last part of "pack/name" paths,
+// so they must not leave a directory or hide in it
+bool is_valid_name(char const* name) {
+    return name[0] != '\0' && name[0] != '.' && !strpbrk(name, "/\\");
+}
+
+
+bool is_valid(Entry const& e, size_t index_end, size_t size) {
+    return e.offset >= index_end && e.offset <= size && e.length <= size - e.offset &&
+           memchr(e.name, 0, NAME_LENGTH) && memchr(e.title, 0, NAME_LENGTH) && is_valid_name(e.name);
+}
+
+
+// packs opened by read, most recently used first. a pack is opened again
+// when its file was replaced or touched
+struct OpenPack {
+    std::string path;
+    dev_t       dev;
+    ino_t       ino;
+    timespec    mtime;
+    off_t       size;
+    Pack        pack;
+};
+
+std::mutex                             m_open_mutex;
+std::vector<std::unique_ptr<OpenPack>> m_open;
+
+
+bool is_same_file(OpenPack const& p, struct stat const& st) {
+    return p.dev == st.st_dev && p.ino == st.st_ino && p.size == st.st_size &&
+           p.mtime.tv_sec == st.st_mtim.tv_sec && p.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+
+// call with m_open_mutex held
+Pack const* open_pack(std::string const& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) return nullptr;
+    auto it = std::find_if(m_open.begin(), m_open.end(), [&](std::unique_ptr<OpenPack> const& p) {
+        return p->path == path;
+    });
+    if (it != m_open.end() && !is_same_file(**it, st)) {
+        m_open.erase(it);
+        it = m_open.end();
+    }
+    if (it == m_open.end()) {
+        std::unique_ptr<OpenPack> p(new OpenPack());
+        // stat before open, a change in between makes the next read open it again
+        if (!p->pack.open(path)) return nullptr;
+        p->path  = path;
+        p->dev   = st.st_dev;
+        p->ino   = st.st_ino;
+        p->mtime = st.st_mtim;
+        p->size  = st.st_size;
+        if (m_open.size() >= OPEN_PACKS) m_open.pop_back();
+        m_open.insert(m_open.begin(), std::move(p));
+    }
+    else std::rotate(m_open.begin(), it, it + 1);
+    return &m_open.front()->pack;
+}
+
+
+} // namespace
+
+
+bool Pack::open(std::string const& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < HEADER_SIZE) {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    m_data = (uint8_t const*) p;
+    m_size = st.st_size;
+
+    uint16_t version;
+    uint32_t count;
+    memcpy(&version, m_data + MAGIC_LENGTH, 2);
+    memcpy(&count, m_data + 8, 4);
+    // divided rather than multiplied, which could overflow a 32 bit size_t
+    if (memcmp(m_data, MAGIC, MAGIC_LENGTH) != 0 || version != VERSION ||
+        count > (m_size - HEADER_SIZE) / sizeof(Entry)) {
+        close();
+        return false;
+    }
+    size_t index_end = HEADER_SIZE + count * sizeof(Entry);
+    m_index = (Entry const*) (m_data + HEADER_SIZE);
+    m_count = count;
+    for (uint32_t i = 0; i < m_count; ++i) {
+        if (!is_valid(m_index[i], index_end, m_size)) {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void Pack::close() {
+    if (m_data) munmap((void*) m_data, m_size);
+    m_data  = nullptr;
+    m_size  = 0;
+    m_index = nullptr;
+    m_count = 0;
+}
+
+
+int Pack::find(std::string const& name) const {
+    Entry const* end = m_index + m_count;
+    Entry const* e = std::lower_bound(m_index, end, name, [](Entry const& e, std::string const& name) {
+        return strcmp(e.name, name.c_str()) < 0;
+    });
+    return e != end && name == e->name ? e - m_index : -1;
+}
+
+
+bool write(std::string const& path, std::vector<std::string> const& files) {
+    struct Item {
+        Entry                entry;
+        std::vector<uint8_t> data;
+    };
+    std::vector<Item> songs;
+    std::unique_ptr<Song> song(new Song());
+    for (std::string const& f : files) {
+        Item s = {};
+        if (!file::read(f, s.data) || !load_song(*song, s.data.data(), s.data.size())) {
+            SDL_Log("pack: skipping %s", f.c_str());
+            continue;
+        }
+        std::string name = f.substr(f.find_last_of('/') + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        if (name.size() >= NAME_LENGTH) {
+            SDL_Log("pack: skipping %s, name too long", f.c_str());
+            continue;
+        }
+        if (!is_valid_name(name.c_str())) {
+            SDL_Log("pack: skipping %s, invalid name", f.c_str());
+            continue;
+        }
+        snprintf(s.entry.name, NAME_LENGTH, "%s", name.c_str());
+        snprintf(s.entry.title, NAME_LENGTH, "%s", song->title.data());
+        s.entry.length = s.data.size();
+        s.entry.hash   = file::hash(s.data.data(), s.data.size());
+        songs.push_back(std::move(s));
+    }
+    std::sort(songs.begin(), songs.end(), [](Item const& a, Item const& b) {
+        return strcmp(a.entry.name, b.entry.name) < 0;
+    });
+    for (size_t i = 1; i < songs.size(); ++i) {
+        if (strcmp(songs[i - 1].entry.name, songs[i].entry.name) == 0) {
+            SDL_Log("pack: duplicate song name %s", songs[i].entry.name);
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> data(HEADER_SIZE);
+    uint16_t version = VERSION;
+    uint32_t count   = songs.size();
+    memcpy(data.data(), MAGIC, MAGIC_LENGTH);
+    memcpy(data.data() + MAGIC_LENGTH, &version, 2);
+    memcpy(data.data() + 8, &count, 4);
+
+    uint64_t offset = HEADER_SIZE + songs.size() * sizeof(Entry);
+    for (Item& s : songs) {
+        s.entry.offset = offset;
+        offset += s.data.size();
+        data.insert(data.end(), (uint8_t const*) &s.entry, (uint8_t const*) (&s.entry + 1));
+    }
+    for (Item const& s : songs) data.insert(data.end(), s.data.begin(), s.data.end());
+    return file::write_atomic(path, data.data(), data.size());
+}
+
+
+bool read(std::string const& path, std::vector<uint8_t>& data) {
+    size_t p = path.rfind(PACK_SUFFIX "/");
+    if (p == std::string::npos) return file::read(path, data);
+
+    std::lock_guard<std::mutex> lock(m_open_mutex);
+    Pack const* pack = open_pack(path.substr(0, p + strlen(PACK_SUFFIX)));
+    if (!pack) return false;
+    int i = pack->find(path.substr(p + strlen(PACK_SUFFIX) + 1));
+    if (i < 0) return false;
+    Entry const& e = pack->entry(i);
+    data.assign(pack->data(e), pack->data(e) + e.length);
+    return true;
+}
+
+
+} // namespace
@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+#define PACK_SUFFIX ".fpk"
+
+
+// many songs in one file, so a library can be opened and browsed without a syscall per song.
+// the file is memory-mapped and the index is used in place.
+namespace pack {
+    enum { NAME_LENGTH = 32 };
+
+    struct Entry {
+        uint64_t offset;        // of the song data from the start of the file
+        uint32_t length;
+        uint32_t reserved;
+        uint64_t hash;          // of the song data
+        char     name[NAME_LENGTH];
+        char     title[NAME_LENGTH];
+    };
+
+    struct Pack {
+        Pack() = default;
+        Pack(Pack const&) = delete;
+        Pack& operator=(Pack const&) = delete;
+        ~Pack() { close(); }
+
+        bool open(std::string const& path);
+        void close();
+
+        int            count() const { return m_count; }
+        Entry const&   entry(int i) const { return m_index[i]; }
+        uint8_t const* data(Entry const& e) const { return m_data + e.offset; }
+        // index of the song or -1
+        int            find(std::string const& name) const;
+
+        uint8_t const* m_data  = nullptr;
+        size_t         m_size  = 0;
+        Entry const*   m_index = nullptr;
+        uint32_t       m_count = 0;
+    };
+
+    // pack the given song files; the song names are the file names without directory and suffix
+    bool write(std::string const& path, std::vector<std::string> const& files);
+
+    // read a song file, or the song `name` from a pack for paths like "dir/songs.fpk/name".
+    // the last few packs stay open until their file changes
+    bool read(std::string const& path, std::vector<uint8_t>& data);
+}
@@ -1,15 +1,12 @@
 #include "player.hpp"
+#include <atomic>
+#include <chrono>
 #include <cmath>
 
 
-namespace player {
 namespace {
 
 
-constexpr Filter     null_filter     = {};
-constexpr Instrument null_instrument = {};
-constexpr Effect     null_effect     = {};
-
 constexpr std::array<int, 16> attack_speeds = {
     168867, 47495, 24124, 15998, 10200, 6908, 5692, 4855,
     3877, 1555, 777, 486, 389, 129, 77, 48,
@@ -21,68 +18,23 @@ constexpr std::array<int, 16> release_speeds = {
 };
 
 
-enum State { RELEASE, ATTACK, DECAY, SUSTAIN };
-
-
-struct Channel {
-    bool              active = true;
-
-    int               note;
-    bool              gate;
-    Instrument const* inst = &null_instrument;
-    int               inst_row;
-    Effect const*     effect = &null_effect;
-    int               effect_row;
-    int               pulsewidth_acc;
-
-    State    state;
-    int      adsr[4];
-    int      flags;
-    uint32_t next_pulsewidth;
-    uint32_t pulsewidth;
-    uint32_t freq;
-
-
-    // internal things
-    int      level;
-    uint32_t phase;
-    uint32_t noise_phase;
-    uint32_t shift = 0x7ffff8;
-    int      noise;
-    bool     filter;
-};
-
-
-struct {
-    Filter const* filter = &null_filter;
-    int           row;
-    int           freq_acc;
-
-    uint8_t       type;
-    float         resonance;
-    float         freq;
-
-    float         high;
-    float         band;
-    float         low;
+} // namespace
 
-} m_filter;
 
+void Player::publish_position(int block) {
+    uint64_t p = uint64_t(m_time) << 32 | block << 16 | m_row << 8 | m_frame;
+    uint32_t i = m_history_pos.load(std::memory_order_relaxed) + 1;
+    m_history[i % HISTORY_SIZE].store(p, std::memory_order_relaxed);
+    m_history_pos.store(i, std::memory_order_release);
+}
 
-Song m_song;
-bool m_is_playing;
-int  m_sample;
-int  m_frame;
-int  m_row;
-int  m_block;
-bool m_block_loop;
-std::array<Channel, CHANNEL_COUNT> m_channels;
-Track::Row m_jam_row;
 
-void apply_track_row(Channel& chan, Track::Row const& row) {
+void Player::apply_track_row(Channel& chan, Track::Row const& row) {
     // instrument
     if (row.instrument > 0) {
-        chan.inst = &m_song.instruments[row.instrument - 1];
+        chan.inst = row.instrument <= (int) m_song.instruments.size()
+                  ? &m_song.instruments[row.instrument - 1]
+                  : &null_instrument;
         Instrument const& inst = *chan.inst;
         chan.adsr[0] = attack_speeds[inst.adsr[0]];
         chan.adsr[1] = release_speeds[inst.adsr[1]];
@@ -107,7 +59,9 @@ void apply_track_row(Channel& chan, Track::Row const& row) {
 
     // effect
     if (row.effect > 0) {
-        chan.effect = &m_song.effects[row.effect - 1];
+        chan.effect = row.effect <= (int) m_song.effects.size()
+                    ? &m_song.effects[row.effect - 1]
+                    : &null_effect;
         chan.effect_row = 0;
     }
 
@@ -122,77 +76,77 @@ void apply_track_row(Channel& chan, Track::Row const& row) {
 }
 
 
-void tick() {
-    // jam
-    apply_track_row(m_channels.back(), m_jam_row);
-    m_jam_row = {};
+void Player::update_channel(Channel& chan) {
+    // instrument
+    Instrument const& inst = *chan.inst;
+    if (inst.length > 0) {
+        if (chan.inst_row >= inst.length) {
+            chan.inst_row = std::min<int>(inst.loop, inst.length - 1);
+        }
+        Instrument::Row row = inst.rows[chan.inst_row++];
+        chan.flags = row.flags;
+        switch (row.operation) {
+        case Instrument::OP_SET:
+            chan.pulsewidth_acc = row.value * 0x10;
+            break;
+        case Instrument::OP_INC:
+            chan.pulsewidth_acc += row.value;
+            chan.pulsewidth_acc &= 0x1ff;
+            break;
+        default:
+            break;
+        }
+        uint32_t p = chan.pulsewidth_acc > 0xff ? chan.pulsewidth_acc : ~chan.pulsewidth_acc & 0x1ff;
+        chan.next_pulsewidth = p * 0x7cccc;
+    }
+
+    // effect
+    Effect const& effect = *chan.effect;
+    if (effect.length > 0) {
+        if (chan.effect_row >= effect.length) {
+            chan.effect_row = std::min<int>(effect.loop, effect.length - 1);
+        }
+        Effect::Row row = effect.rows[chan.effect_row++];
+        float n = 0;
+        switch (row.operation) {
+        case Effect::OP_RELATIVE:
+            n = chan.note - 58 + row.value - 0x30;
+            break;
+        case Effect::OP_ABSOLUTE:
+            n = 1         - 58 + row.value;
+            break;
+        case Effect::OP_DETUNE:
+            n = chan.note - 58 + (row.value - 0x30) * 0.25;
+            break;
+        default:
+            break;
+        }
+        chan.freq = exp2f(n / 12) * (1 << 28) * 440 / MIXRATE;
+    }
+}
+
+
+void Player::tick() {
+    int block_nr = m_block;
+    if (block_nr >= m_song.table_length) block_nr = 0;
+    publish_position(block_nr);
 
     // row_update
     if (m_is_playing && m_frame == 0) {
-        int block_nr = m_block;
-        if (block_nr >= m_song.table_length) block_nr = 0;
         Song::Block const& block = m_song.table[block_nr];
 
         for (int c = 0; c < CHANNEL_COUNT; ++c) {
             Channel& chan = m_channels[c];
             int track_nr = block[c];
-            if (track_nr == 0) continue;
+            // tracks the song does not hold are empty
+            if (track_nr == 0 || track_nr > (int) m_song.tracks.size()) continue;
             Track const& track = m_song.tracks[track_nr - 1];
             apply_track_row(chan, track.rows[m_row]);
         }
     }
 
     // frame update
-    for (int c = 0; c < CHANNEL_COUNT; ++c) {
-        Channel& chan = m_channels[c];
-
-        // instrument
-        Instrument const& inst = *chan.inst;
-        if (inst.length > 0) {
-            if (chan.inst_row >= inst.length) {
-                chan.inst_row = std::min<int>(inst.loop, inst.length - 1);
-            }
-            Instrument::Row row = inst.rows[chan.inst_row++];
-            chan.flags = row.flags;
-            switch (row.operation) {
-            case Instrument::OP_SET:
-                chan.pulsewidth_acc = row.value * 0x10;
-                break;
-            case Instrument::OP_INC:
-                chan.pulsewidth_acc += row.value;
-                chan.pulsewidth_acc &= 0x1ff;
-                break;
-            default:
-                break;
-            }
-            uint32_t p = chan.pulsewidth_acc > 0xff ? chan.pulsewidth_acc : ~chan.pulsewidth_acc & 0x1ff;
-            chan.next_pulsewidth = p * 0x7cccc;
-        }
-
-        // effect
-        Effect const& effect = *chan.effect;
-        if (effect.length > 0) {
-            if (chan.effect_row >= effect.length) {
-                chan.effect_row = std::min<int>(effect.loop, effect.length - 1);
-            }
-            Effect::Row row = effect.rows[chan.effect_row++];
-            float n = 0;
-            switch (row.operation) {
-            case Effect::OP_RELATIVE:
-                n = chan.note - 58 + row.value - 0x30;
-                break;
-            case Effect::OP_ABSOLUTE:
-                n = 1         - 58 + row.value;
-                break;
-            case Effect::OP_DETUNE:
-                n = chan.note - 58 + (row.value - 0x30) * 0.25;
-                break;
-            default:
-                break;
-            }
-            chan.freq = exp2f(n / 12) * (1 << 28) * 440 / MIXRATE;
-        }
-    }
+    for (Channel& chan : m_channels) update_channel(chan);
 
     // filter
     Filter const& filter = *m_filter.filter;
@@ -244,11 +198,12 @@ void tick() {
         for (int c = 0; c < CHANNEL_COUNT; ++c) {
             Channel& chan = m_channels[c];
             int track_nr = block[c];
-            if (track_nr == 0) continue;
+            // tracks the song does not hold are empty
+            if (track_nr == 0 || track_nr > (int) m_song.tracks.size()) continue;
             Track const& track = m_song.tracks[track_nr - 1];
             Track::Row const& row = track.rows[row_nr];
 
-            if (row.instrument > 0) {
+            if (row.instrument > 0 && row.instrument <= (int) m_song.instruments.size()) {
                 Instrument const& inst = m_song.instruments[row.instrument - 1];
                 if (inst.hard_restart) {
                     chan.gate = false;
@@ -273,10 +228,12 @@ void tick() {
 }
 
 
-void mix(short* buffer, int length) {
+template<bool STEMS>
+void Player::mix(short* buffer, int length) {
     for (int i = 0; i < length; ++i) {
 
         int out[2] = {};
+        int voices[CHANNEL_COUNT] = {};
 
         for (int c = 0; c < CHANNEL_COUNT; ++c) {
             Channel& chan = m_channels[c];
@@ -363,6 +320,7 @@ void mix(short* buffer, int length) {
             v = ((v - 0x80) * chan.level) >> 18;
 
             out[chan.filter] += v;
+            if (STEMS) voices[c] = v;
         }
 
 
@@ -376,28 +334,86 @@ void mix(short* buffer, int length) {
         if (m_filter.type & FILTER_HIGH) f += m_filter.high;
 
         int sample = out[0] + f;
-        buffer[i] = std::max(-32768, std::min<int>(sample, 32767));
-    }
-}
+        if (!STEMS) {
+            buffer[i] = std::max(-32768, std::min<int>(sample, 32767));
+            continue;
+        }
 
+        short* frame = buffer + i * STEM_CHANNELS;
+        frame[0] = std::max(-32768, std::min<int>(sample, 32767));
+        for (int c = 0; c < CHANNEL_COUNT; ++c) {
+            FilterState::Voice& fv = m_filter.voices[c];
+            int in = m_channels[c].filter ? voices[c] : 0;
+
+            // a voice off the filter only rings out. drop the tail once it is inaudible,
+            // before it decays into slow denormals
+            if (in == 0 && std::abs(fv.band) + std::abs(fv.low) < 0.5f) {
+                fv = {};
+                frame[1 + c * 2] = frame[2 + c * 2] = std::max(-32768, std::min<int>(voices[c], 32767));
+                continue;
+            }
 
-} // namespace
+            fv.high = in - fv.band * m_filter.resonance - fv.low;
+            fv.band += m_filter.freq * fv.high;
+            fv.low  += m_filter.freq * fv.band;
+            int vf = 0;
+            if (m_filter.type & FILTER_LOW)  vf += fv.low;
+            if (m_filter.type & FILTER_BAND) vf += fv.band;
+            if (m_filter.type & FILTER_HIGH) vf += fv.high;
+
+            int post = voices[c] - in + vf;
+            frame[1 + c * 2] = std::max(-32768, std::min<int>(voices[c], 32767));
+            frame[2 + c * 2] = std::max(-32768, std::min<int>(post, 32767));
+        }
+    }
+}
 
 
-void fill_buffer(short* buffer, int length) {
+template<bool STEMS>
+void Player::render(short* buffer, int length) {
     while (length > 0) {
         if (m_sample == 0) tick();
         int l = std::min(SAMPLES_PER_FRAME - m_sample, length);
         m_sample += l;
+        m_time   += l;
         if (m_sample == SAMPLES_PER_FRAME) m_sample = 0;
         length -= l;
-        mix(buffer, l);
-        buffer += l;
+        mix<STEMS>(buffer, l);
+        buffer += l * (STEMS ? STEM_CHANNELS : 1);
     }
 }
 
 
-void reset() {
+void Player::fill_buffer(short* buffer, int length) {
+    // events are placed at their sample time. late ones take effect at the start
+    // of the buffer, the ones beyond its end wait for the next call
+    uint32_t start = m_time;
+    int      pos   = 0;
+    uint32_t r = m_jam_read.load(std::memory_order_relaxed);
+    uint32_t w = m_jam_write.load(std::memory_order_acquire);
+    for (; r != w; ++r) {
+        JamEvent& e = m_jam_queue[r % JAM_QUEUE_SIZE];
+        int offset = std::max<int32_t>(e.time - start, pos);
+        if (offset >= length) break;
+        render<false>(buffer + pos, offset - pos);
+        pos = offset;
+
+        // the next tick steps the instrument, like for any other row
+        e.applied = m_time;
+        apply_track_row(m_channels.back(), e.row);
+    }
+    m_jam_read.store(r, std::memory_order_release);
+
+    render<false>(buffer + pos, length - pos);
+}
+
+
+void Player::fill_stems(short* buffer, int length) {
+    render<true>(buffer, length);
+}
+
+
+void Player::reset() {
     m_sample = 0;
     m_frame = 0;
     m_row = 0;
@@ -412,7 +428,7 @@ void reset() {
 }
 
 
-void set_playing(bool p) {
+void Player::set_playing(bool p) {
     m_is_playing = p;
     if (!m_is_playing) {
         m_filter = {};
@@ -424,16 +440,98 @@ void set_playing(bool p) {
     }
 }
 
-int   row() { return m_row; }
-int   block() { return m_block; }
-void  block(int b) { m_block = b; }
-bool  block_loop() { return m_block_loop; }
-void  block_loop(bool b) { m_block_loop = b; }
-bool  is_channel_active(int c) { return m_channels[c].active; }
-void  set_channel_active(int c, bool a) { m_channels[c].active = a; }
-void  jam(Track::Row const& row) { m_jam_row = row; }
+
+void Player::jam(Track::Row const& row, uint32_t time) {
+    uint32_t w = m_jam_write.load(std::memory_order_relaxed);
+    if (w - m_jam_read.load(std::memory_order_acquire) >= JAM_QUEUE_SIZE) return;
+    m_jam_queue[w % JAM_QUEUE_SIZE] = { time, row, 0 };
+    m_jam_write.store(w + 1, std::memory_order_release);
+}
+
+
+Player::Checkpoint Player::checkpoint() const {
+    return { m_is_playing, m_sample, m_frame, m_row, m_block, m_block_loop, m_channels, m_filter };
+}
+
+
+void Player::restore(Checkpoint const& c) {
+    m_is_playing = c.is_playing;
+    m_sample     = c.sample;
+    m_frame      = c.frame;
+    m_row        = c.row;
+    m_block      = c.block;
+    m_block_loop = c.block_loop;
+    m_channels   = c.channels;
+    m_filter     = c.filter;
+}
+
+
+void Player::rewind(Checkpoint const& c, uint32_t time) {
+    restore(c);
+    m_time = time;
+
+    // put back the events applied after that, as long as jam has not reused their slots
+    uint32_t r = m_jam_read.load(std::memory_order_relaxed);
+    uint32_t w = m_jam_write.load(std::memory_order_acquire);
+    while (r != 0 && w - r < JAM_QUEUE_SIZE &&
+           int32_t(m_jam_queue[(r - 1) % JAM_QUEUE_SIZE].applied - time) >= 0) --r;
+    m_jam_read.store(r, std::memory_order_release);
+}
+
+
+Player::Position Player::position(uint32_t time) const {
+    uint32_t i = m_history_pos.load(std::memory_order_acquire);
+    for (int n = 0; n < HISTORY_SIZE - 1; ++n, --i) {
+        uint64_t p = m_history[i % HISTORY_SIZE].load(std::memory_order_relaxed);
+        if (int32_t(time - uint32_t(p >> 32)) >= 0) {
+            return { int(p >> 16 & 0xffff), int(p >> 8 & 0xff), int(p & 0xff) };
+        }
+    }
+    // older than anything we remember
+    uint64_t p = m_history[(i + 1) % HISTORY_SIZE].load(std::memory_order_relaxed);
+    return { int(p >> 16 & 0xffff), int(p >> 8 & 0xff), int(p & 0xff) };
+}
+
+
+
+namespace player {
+namespace {
+
+
+// all items are reserved up front, so growing the song never moves
+// the instruments and effects the synth points to
+Song make_song() {
+    Song song;
+    reserve_song(song);
+    return song;
+}
+
+
+Song   m_song = make_song();
+Player m_player(m_song);
+
+
+} // namespace
+
+
+void  fill_buffer(short* buffer, int length) { m_player.fill_buffer(buffer, length); }
+void  reset() { m_player.reset(); }
+void  set_playing(bool p) { m_player.set_playing(p); }
+bool  is_playing() { return m_player.is_playing(); }
+int   row() { return m_player.row(); }
+int   block() { return m_player.block(); }
+void  block(int b) { m_player.block(b); }
+bool  block_loop() { return m_player.block_loop(); }
+void  block_loop(bool b) { m_player.block_loop(b); }
+bool  is_channel_active(int c) { return m_player.is_channel_active(c); }
+void  set_channel_active(int c, bool a) { m_player.set_channel_active(c, a); }
+void  jam(Track::Row const& row, uint32_t time) { m_player.jam(row, time); }
 Song& song() { return m_song; }
-bool  is_playing() { return m_is_playing; }
+uint32_t time() { return m_player.time(); }
+Position position(uint32_t time) { return m_player.position(time); }
+Player::Checkpoint checkpoint() { return m_player.checkpoint(); }
+void  restore(Player::Checkpoint const& c) { m_player.restore(c); }
+void  rewind(Player::Checkpoint const& c, uint32_t time) { m_player.rewind(c, time); }
 
 
-} // namespace;
+} // namespace
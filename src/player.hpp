@@ -1,15 +1,179 @@
 #pragma once
 #include "song.hpp"
+#include <atomic>
 
 
 enum {
     MIXRATE               = 44100,
     FRAMES_PER_SECOND     = 50,
     SAMPLES_PER_FRAME     = MIXRATE / FRAMES_PER_SECOND,
+
+    // bump when the same song renders to different samples, it invalidates rendered files
+    ENGINE_VERSION        = 1,
+};
+
+
+// one instance of the synth engine playing a song.
+// the editor uses the global instance behind the player namespace,
+// background renderers create their own.
+class Player {
+public:
+    struct Position {
+        int block;
+        int row;
+        int frame;
+    };
+
+    // stem frames: the master, then each voice before and after the filter
+    enum { STEM_CHANNELS = 1 + CHANNEL_COUNT * 2 };
+
+    explicit Player(Song const& song) : m_song(song) {}
+
+    void     fill_buffer(short* buffer, int length);
+    // interleaved stem frames in one pass. the master is the same as from fill_buffer,
+    // jam events are ignored
+    void     fill_stems(short* buffer, int length);
+    void     reset();
+    void     set_playing(bool p);
+    bool     is_playing() const { return m_is_playing; }
+    int      row() const { return m_row; }
+    int      block() const { return m_block; }
+    void     block(int b) { m_block = b; }
+    bool     block_loop() const { return m_block_loop; }
+    void     block_loop(bool b) { m_block_loop = b; }
+    bool     is_channel_active(int c) const { return m_channels[c].active; }
+    void     set_channel_active(int c, bool a) { m_channels[c].active = a; }
+    // play a row on the last channel once rendering reaches the given sample time
+    void     jam(Track::Row const& row, uint32_t time);
+    Song const& song() const { return m_song; }
+
+    // samples rendered so far
+    uint32_t time() const { return m_time; }
+    // position of the frame that was playing at the given sample time
+    Position position(uint32_t time) const;
+
+private:
+    enum State { RELEASE, ATTACK, DECAY, SUSTAIN };
+
+    enum {
+        JAM_QUEUE_SIZE = 32,
+        HISTORY_SIZE   = 64,
+    };
+
+    static constexpr Filter     null_filter     = {};
+    static constexpr Instrument null_instrument = {};
+    static constexpr Effect     null_effect     = {};
+
+    struct Channel {
+        bool              active = true;
+
+        int               note;
+        bool              gate;
+        Instrument const* inst = &null_instrument;
+        int               inst_row;
+        Effect const*     effect = &null_effect;
+        int               effect_row;
+        int               pulsewidth_acc;
+
+        State    state;
+        int      adsr[4];
+        int      flags;
+        uint32_t next_pulsewidth;
+        uint32_t pulsewidth;
+        uint32_t freq;
+
+
+        // internal things
+        int      level;
+        uint32_t phase;
+        uint32_t noise_phase;
+        uint32_t shift = 0x7ffff8;
+        int      noise;
+        bool     filter;
+    };
+
+    struct FilterState {
+        Filter const* filter = &null_filter;
+        int           row;
+        int           freq_acc;
+
+        uint8_t       type;
+        float         resonance;
+        float         freq;
+
+        float         high;
+        float         band;
+        float         low;
+
+        // the filter is linear, so running it on each voice alone splits its output by voice
+        struct Voice {
+            float high;
+            float band;
+            float low;
+        };
+        std::array<Voice, CHANNEL_COUNT> voices;
+    };
+
+    // jam events are queued by the ui thread and consumed by fill_buffer
+    struct JamEvent {
+        uint32_t   time;
+        Track::Row row;
+        uint32_t   applied;     // sample time it took effect, kept for rewind
+    };
+
+    void publish_position(int block);
+    void apply_track_row(Channel& chan, Track::Row const& row);
+    void update_channel(Channel& chan);
+    void tick();
+    template<bool STEMS> void mix(short* buffer, int length);
+    template<bool STEMS> void render(short* buffer, int length);
+
+public:
+    // the synth state without the sample clock, to resume a song where it was left.
+    // it refers to instruments and effects by address, so restore it with the same song object
+    struct Checkpoint {
+        bool                               is_playing;
+        int                                sample;
+        int                                frame;
+        int                                row;
+        int                                block;
+        bool                               block_loop;
+        std::array<Channel, CHANNEL_COUNT> channels;
+        FilterState                        filter;
+    };
+
+    Checkpoint checkpoint() const;
+    void       restore(Checkpoint const& c);
+    // restore a checkpoint taken at the given sample time to render from there again.
+    // jam events applied since then are applied again
+    void       rewind(Checkpoint const& c, uint32_t time);
+
+private:
+    Song const&                        m_song;
+    bool                               m_is_playing = false;
+    int                                m_sample     = 0;
+    uint32_t                           m_time       = 0;
+    int                                m_frame      = 0;
+    int                                m_row        = 0;
+    int                                m_block      = 0;
+    bool                               m_block_loop = false;
+    std::array<Channel, CHANNEL_COUNT> m_channels;
+    FilterState                        m_filter;
+
+    std::array<JamEvent, JAM_QUEUE_SIZE> m_jam_queue;
+    std::atomic<uint32_t>                m_jam_read{0};
+    std::atomic<uint32_t>                m_jam_write{0};
+
+    // positions of the most recent frames, packed as time << 32 | block << 16 | row << 8 | frame,
+    // so the ui can read them without locking
+    std::array<std::atomic<uint64_t>, HISTORY_SIZE> m_history = {};
+    std::atomic<uint32_t>                           m_history_pos{0};
 };
 
 
 namespace player {
+    using Position = Player::Position;
+
     void  fill_buffer(short* buffer, int length);
     void  reset();
     void  set_playing(bool p);
@@ -21,6 +185,13 @@ namespace player {
     void  block_loop(bool b);
     bool  is_channel_active(int c);
     void  set_channel_active(int c, bool a);
-    void  jam(Track::Row const& row);
+    void  jam(Track::Row const& row, uint32_t time);
     Song& song();
+
+    uint32_t time();
+    Position position(uint32_t time);
+
+    Player::Checkpoint checkpoint();
+    void               restore(Player::Checkpoint const& c);
+    void               rewind(Player::Checkpoint const& c, uint32_t time);
 }
@@ -0,0 +1,208 @@
+#include "preview.hpp"
+#include "file.hpp"
+#include "pack.hpp"
+#include <SDL.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <cinttypes>
+
+
+namespace preview {
+namespace {
+
+
+// cache file format:
+//
+//   magic "FSPV", u16 version, thumbnail, u32 snippet length, snippet
+//
+// in host layout, the cache never leaves the device.
+
+constexpr char MAGIC[]      = "FSPV";
+constexpr int  MAGIC_LENGTH = sizeof(MAGIC) - 1;
+enum {
+    VERSION        = 1,
+    MAX_WORKERS    = 3,
+    MAX_LOADED     = 32,
+    // longer songs only get a thumbnail of their beginning
+    MAX_SECONDS    = 300,
+};
+
+
+struct Request {
+    std::string path;
+    uint64_t    hash;
+};
+
+
+std::string                                         m_cache_dir;
+std::vector<SDL_Thread*>                            m_threads;
+bool                                                m_running;
+SDL_mutex*                                          m_mutex;
+SDL_cond*                                           m_cond;
+std::vector<Request>                                m_requests;
+std::set<uint64_t>                                  m_pending;
+std::map<uint64_t, std::shared_ptr<Preview const>>  m_previews;
+std::deque<uint64_t>                                m_loaded;
+
+
+std::string cache_path(uint64_t hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".prv", hash);
+    return m_cache_dir + name;
+}
+
+
+bool load(Preview& p, uint64_t hash) {
+    std::vector<uint8_t> data;
+    if (!file::read(cache_path(hash), data)) return false;
+    size_t header = MAGIC_LENGTH + 2 + THUMBNAIL_SIZE + 4;
+    if (data.size() < header || memcmp(data.data(), MAGIC, MAGIC_LENGTH) != 0) return false;
+    uint16_t version;
+    uint32_t length;
+    memcpy(&version, &data[MAGIC_LENGTH], 2);
+    memcpy(&length, &data[header - 4], 4);
+    if (version != VERSION || data.size() != header + length * sizeof(short)) return false;
+    memcpy(p.thumbnail.data(), &data[MAGIC_LENGTH + 2], THUMBNAIL_SIZE);
+    p.snippet.resize(length);
+    memcpy(p.snippet.data(), &data[header], length * sizeof(short));
+    return true;
+}
+
+
+void save(Preview const& p, uint64_t hash) {
+    std::vector<uint8_t> data(MAGIC, MAGIC + MAGIC_LENGTH);
+    uint16_t version = VERSION;
+    uint32_t length  = p.snippet.size();
+    data.insert(data.end(), (uint8_t const*) &version, (uint8_t const*) &version + 2);
+    data.insert(data.end(), p.thumbnail.begin(), p.thumbnail.end());
+    data.insert(data.end(), (uint8_t const*) &length, (uint8_t const*) &length + 4);
+    data.insert(data.end(), (uint8_t const*) p.snippet.data(), (uint8_t const*) (p.snippet.data() + length));
+    file::write_atomic(cache_path(hash), data.data(), data.size());
+}
+
+
+bool render(Preview& p, std::string const& path) {
+    std::vector<uint8_t> data;
+    if (!pack::read(path, data)) return false;
+    std::unique_ptr<Song> song(new Song());
+    if (!load_song(*song, data.data(), data.size())) return false;
+
+    std::unique_ptr<Player> player(new Player(*song));
+    player->set_playing(true);
+    player->reset();
+
+    int length = std::min<int>(song_frame_count(*song) * SAMPLES_PER_FRAME, MAX_SECONDS * MIXRATE);
+    int snippet_length = std::min<int>(length, SNIPPET_SECONDS * MIXRATE);
+    p.thumbnail = {};
+    p.snippet.clear();
+    p.snippet.reserve(snippet_length / 2);
+
+    std::array<short, 1024> buffer;
+    int peak = 0;
+    int slice = 0;
+    for (int pos = 0; pos < length;) {
+        int len = std::min<int>(buffer.size(), length - pos);
+        player->fill_buffer(buffer.data(), len);
+        for (int i = 0; i < len; ++i, ++pos) {
+            // the buffer always starts at an even position
+            if (pos < snippet_length && pos % 2 == 1) p.snippet.push_back((buffer[i - 1] + buffer[i]) / 2);
+            peak = std::max(peak, std::abs(buffer[i]));
+            int s = int64_t(pos) * THUMBNAIL_SIZE / length;
+            if (s != slice) {
+                p.thumbnail[slice] = std::min(peak >> 7, 255);
+                slice = s;
+                peak  = 0;
+            }
+        }
+    }
+    if (length > 0) p.thumbnail[slice] = std::min(peak >> 7, 255);
+    return true;
+}
+
+
+int worker_func(void*) {
+    SDL_LockMutex(m_mutex);
+    while (m_running) {
+        if (m_requests.empty()) {
+            SDL_CondWait(m_cond, m_mutex);
+            continue;
+        }
+        Request r = std::move(m_requests.back());
+        m_requests.pop_back();
+        SDL_UnlockMutex(m_mutex);
+
+        std::shared_ptr<Preview> p = std::make_shared<Preview>();
+        bool ok = load(*p, r.hash);
+        if (!ok && render(*p, r.path)) {
+            save(*p, r.hash);
+            ok = true;
+        }
+
+        // broken songs stay pending, so they are not tried again
+        SDL_LockMutex(m_mutex);
+        if (ok) {
+            m_pending.erase(r.hash);
+            m_previews[r.hash] = p;
+            m_loaded.push_back(r.hash);
+            if (m_loaded.size() > MAX_LOADED) {
+                m_previews.erase(m_loaded.front());
+                m_loaded.pop_front();
+            }
+        }
+    }
+    SDL_UnlockMutex(m_mutex);
+    return 0;
+}
+
+
+} // namespace
+
+
+void init(std::string const& cache_dir) {
+    m_cache_dir = cache_dir;
+    m_mutex     = SDL_CreateMutex();
+    m_cond      = SDL_CreateCond();
+    m_running   = true;
+    int n = std::max(1, std::min<int>(SDL_GetCPUCount() - 1, MAX_WORKERS));
+    for (int i = 0; i < n; ++i) {
+        m_threads.push_back(SDL_CreateThread(worker_func, "preview", nullptr));
+    }
+}
+
+
+void free() {
+    if (!m_mutex) return;
+    SDL_LockMutex(m_mutex);
+    m_running = false;
+    m_requests.clear();
+    SDL_CondBroadcast(m_cond);
+    SDL_UnlockMutex(m_mutex);
+    for (SDL_Thread* t : m_threads) SDL_WaitThread(t, nullptr);
+    m_threads.clear();
+    m_previews.clear();
+    m_loaded.clear();
+    m_pending.clear();
+    SDL_DestroyCond(m_cond);
+    SDL_DestroyMutex(m_mutex);
+    m_mutex = nullptr;
+}
+
+
+std::shared_ptr<Preview const> get(std::string const& path, uint64_t hash) {
+    if (!m_mutex) return nullptr;
+    std::shared_ptr<Preview const> p;
+    SDL_LockMutex(m_mutex);
+    auto it = m_previews.find(hash);
+    if (it != m_previews.end()) p = it->second;
+    else if (m_pending.insert(hash).second) {
+        m_requests.push_back({ path, hash });
+        SDL_CondSignal(m_cond);
+    }
+    SDL_UnlockMutex(m_mutex);
+    return p;
+}
+
+
+} // namespace
@@ -0,0 +1,28 @@
+#pragma once
+#include "player.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+
+
+// song previews for the file list, rendered by a pool of background workers
+// on their own player instances and cached on disk by file content hash
+namespace preview {
+    enum {
+        THUMBNAIL_SIZE  = 64,
+        SNIPPET_RATE    = MIXRATE / 2,
+        SNIPPET_SECONDS = 6,
+    };
+
+    struct Preview {
+        std::array<uint8_t, THUMBNAIL_SIZE> thumbnail;  // peak level of each slice of the song
+        std::vector<short>                  snippet;    // the beginning of the song at SNIPPET_RATE
+    };
+
+    void init(std::string const& cache_dir);
+    void free();
+
+    // returns nullptr until the preview is ready; missing previews are queued,
+    // the most recently requested one is rendered first
+    std::shared_ptr<Preview const> get(std::string const& path, uint64_t hash);
+}
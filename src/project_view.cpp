@@ -2,13 +2,23 @@
 #include "edit.hpp"
 #include "gui.hpp"
 #include "player.hpp"
+#include "audio.hpp"
+#include "journal.hpp"
+#include "history.hpp"
+#include "library.hpp"
+#include "preview.hpp"
+#include "song_cache.hpp"
+#include "pack.hpp"
+#include "exporter.hpp"
+#include "render_cache.hpp"
 #include "android.hpp"
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string>
-#include <dirent.h>
+#include <cctype>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <sndfile.h>
 
 
 #define FILE_SUFFIX ".sng"
@@ -21,34 +31,18 @@ std::string get_storage_dir();
 namespace {
 
 
-sf_count_t get_filelen(void* user_data) {
-    return SDL_RWsize((SDL_RWops*) user_data);
-}
-
-sf_count_t seek(sf_count_t offset, int whence, void* user_data) {
-    int w = whence == SEEK_CUR ? RW_SEEK_CUR
-          : whence == SEEK_SET ? RW_SEEK_SET
-                               : RW_SEEK_END;
-    return SDL_RWseek((SDL_RWops*) user_data, offset, w);
-}
-
-sf_count_t read(void* ptr, sf_count_t count, void* user_data) {
-    return SDL_RWread((SDL_RWops*) user_data, ptr, 1, count);
-}
-
-sf_count_t write(const void* ptr, sf_count_t count, void* user_data) {
-    return SDL_RWwrite((SDL_RWops*) user_data, ptr, 1, count);
-}
-
-sf_count_t tell(void* user_data) {
-    return SDL_RWtell((SDL_RWops*) user_data);
-}
+// bytes of exported files kept for re-exports of unchanged songs
+constexpr uint64_t RENDER_CACHE_BUDGET = 256 << 20;
 
 
-
-int                      m_file_scroll;
-std::array<char, 28>     m_file_name;
-std::vector<std::string> m_file_names;
+int                         m_file_scroll;
+std::array<char, 64>        m_file_name;
+std::array<char, 28>        m_search;
+std::string                 m_filter;
+std::vector<library::Entry> m_entries;
+std::vector<int>            m_visible;  // entries matching the search
+uint64_t                    m_audition_hash;
+Uint32                      m_audition_end;
 std::string              m_root_dir;
 std::string              m_songs_dir;
 std::string              m_exports_dir;
@@ -62,6 +56,28 @@ void status(std::string const& msg) {
 }
 
 
+// songs in a pack are listed as "pack/song"
+bool is_in_pack(std::string const& name) {
+    return name.find('/') != std::string::npos;
+}
+
+std::string song_path(std::string const& name) {
+    size_t p = name.find('/');
+    if (p == std::string::npos) return m_songs_dir + name + FILE_SUFFIX;
+    return m_songs_dir + name.substr(0, p) + PACK_SUFFIX + name.substr(p);
+}
+
+// the inverse of song_path(), empty for paths outside of the songs directory
+std::string song_name(std::string const& path) {
+    if (path.compare(0, m_songs_dir.size(), m_songs_dir) != 0) return "";
+    std::string name = path.substr(m_songs_dir.size());
+    size_t p = name.find(PACK_SUFFIX "/");
+    if (p != std::string::npos) return name.erase(p, strlen(PACK_SUFFIX));
+    if (name.size() <= 4) return "";
+    return name.substr(0, name.size() - 4);
+}
+
+
 bool copy_demo_song(std::string const& name) {
 
     std::string dst_name = m_songs_dir + name + FILE_SUFFIX;
@@ -104,10 +120,12 @@ bool init_dirs() {
 
     m_songs_dir   = m_root_dir + "/songs/";
     m_exports_dir = m_root_dir + "/exports/";
+    std::string previews_dir = m_root_dir + "/previews/";
 
     if (stat(m_root_dir.c_str(), &st) == -1)    mkdir(m_root_dir.c_str(), 0700);
     if (stat(m_songs_dir.c_str(), &st) == -1)   mkdir(m_songs_dir.c_str(), 0700);
     if (stat(m_exports_dir.c_str(), &st) == -1) mkdir(m_exports_dir.c_str(), 0700);
+    if (stat(previews_dir.c_str(), &st) == -1)  mkdir(previews_dir.c_str(), 0700);
 
     copy_demo_song("demo1");
     copy_demo_song("demo2");
@@ -116,112 +134,27 @@ bool init_dirs() {
 }
 
 
-enum ExportFormat { EF_OGG, EF_WAV };
-
-ExportFormat m_export_format = EF_OGG;
-SDL_Thread*  m_export_thread;
-bool         m_export_canceled;
-bool         m_export_done;
-float        m_export_progress;
-SDL_RWops*   m_export_file;
-SNDFILE*     m_export_sndfile;
-
-
-int export_thread_func(void*) {
-
-    Song& song = player::song();
-    static std::array<short, 1024> buffer;
-
-    int frames = (song.track_length * song.tempo + song.track_length / 2 * song.swing) * song.table_length;
-    const int samples = frames * SAMPLES_PER_FRAME;
-    int samples_left = samples;
-
-    player::block_loop(false);
-    player::set_playing(true);
-    player::reset();
-
-    while (samples_left > 0 && !m_export_canceled) {
-        int len = std::min<int>(samples_left, buffer.size());
-        samples_left -= len;
-        player::fill_buffer(buffer.data(), len);
-        sf_writef_short(m_export_sndfile, buffer.data(), len);
-        m_export_progress = float(samples - samples_left) / samples;
-    }
-
-    sf_close(m_export_sndfile);
-    SDL_RWclose(m_export_file);
-    m_export_sndfile = nullptr;
-    m_export_file    = nullptr;
-
-    player::set_playing(false);
-    player::reset();
-
-    m_export_done = true;
-
-    return 0;
-}
+int m_export_formats = 1 << exporter::OGG;
 
 
 void draw_export_progress() {
     gfx::font(FONT_DEFAULT);
     auto widths = calculate_column_widths({ -1 });
     gui::min_item_size({ widths[0], BUTTON_BIG });
-    if (gui::button("Cancel")) m_export_canceled = true;
+    if (gui::button("Cancel")) exporter::cancel();
 
     gfx::font(FONT_MONO);
     gui::min_item_size({ widths[0], BUTTON_BIG });
-    gui::text("%3d %%", int(m_export_progress * 100));
+    gui::text("%3d %%", int(exporter::progress() * 100));
 
-    if (m_export_done) {
-        int ret;
-        SDL_WaitThread(m_export_thread, &ret);
+    if (exporter::is_done()) {
         edit::set_popup(nullptr);
-        SDL_PauseAudio(0);
-        if (m_export_canceled) status("Song export was canceled");
-        else status("Song was exported");
+        if (exporter::finish()) status("Song was exported");
+        else status("Song export was canceled");
     }
 }
 
 
-bool open_export_file(std::string const& name) {
-
-    SF_INFO info = { 0, MIXRATE, 1 };
-    std::string path = m_exports_dir + name;
-    if (m_export_format == EF_OGG) {
-        info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
-        path += ".ogg";
-    }
-    else {
-        info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
-        path += ".wav";
-    }
-
-    m_export_file = SDL_RWFromFile(path.c_str(), "wb");
-    if (!m_export_file) return false;
-
-    SF_VIRTUAL_IO vio = {
-        get_filelen,
-        seek,
-        read,
-        write,
-        tell,
-    };
-
-    m_export_sndfile = sf_open_virtual(&vio, SFM_WRITE, &info, m_export_file);
-    if (!m_export_sndfile) {
-        SDL_RWclose(m_export_file);
-        m_export_file = nullptr;
-        return false;
-    }
-
-    // TODO: set quality
-    //double quality = 0.8;
-    //sf_command(m_export_sndfile, SFC_SET_VBR_ENCODING_QUALITY, &quality, sizeof(quality));
-
-    return m_export_sndfile != nullptr;
-}
-
-
 void init_export() {
 
     std::string name = m_file_name.data();
@@ -231,26 +164,20 @@ void init_export() {
         return;
     }
 
-    if (!open_export_file(name)) {
-        status("Export error: couldn't open file");
+    // all formats from one render
+    std::vector<exporter::Target> targets;
+    for (int f = exporter::OGG; f <= exporter::STEMS; ++f) {
+        if (m_export_formats & 1 << f) targets.push_back({ exporter::Format(f) });
+    }
+    if (targets.empty()) {
+        status("Export error: no format selected");
         return;
     }
 
-    // stop
-    //TODO: ensure that the callback has exited
-    SDL_PauseAudio(1);
-
-    // set meta info
-    Song& song = player::song();
-    sf_set_string(m_export_sndfile, SF_STR_TITLE, song.title.data());
-    sf_set_string(m_export_sndfile, SF_STR_ARTIST, song.author.data());
-
-    // start thread
-    m_export_canceled = false;
-    m_export_done     = false;
-    m_export_progress = 0;
-    m_export_thread   = SDL_CreateThread(export_thread_func, "song export", nullptr);
-
+    if (!exporter::start(player::song(), m_exports_dir + name, targets)) {
+        status("Export error: couldn't open file");
+        return;
+    }
 
     // popup
     edit::set_popup(draw_export_progress);
@@ -267,9 +194,141 @@ enum ConfirmationType {
 ConfirmationType m_confirmation_type;
 
 
+bool contains(std::string const& s, std::string const& pattern) {
+    return std::search(s.begin(), s.end(), pattern.begin(), pattern.end(), [](char a, char b) {
+        return tolower(a) == tolower(b);
+    }) != s.end();
+}
+
+
+void update_visible() {
+    m_filter = m_search.data();
+    m_visible.clear();
+    for (int i = 0; i < (int) m_entries.size(); ++i) {
+        library::Entry const& e = m_entries[i];
+        if (contains(e.name, m_filter) || contains(e.title, m_filter) || contains(e.author, m_filter)) {
+            m_visible.push_back(i);
+        }
+    }
+}
+
+
+SDL_Thread*           m_save_thread;
+std::atomic<bool>     m_save_done;
+bool                  m_save_ok;
+std::string           m_save_path;
+std::unique_ptr<Song> m_save_song;
+bool                  m_journal_failed;
+
+
+// the file of the song being edited, empty for a new song, and its content on disk
+std::string           m_song_path;
+std::unique_ptr<Song> m_base_song;
+
+
+bool is_dirty() {
+    return !songs_equal(player::song(), *m_base_song);
+}
+
+
+// make `e` the song being edited. the current song goes into the cache if it has a file
+void switch_song(std::unique_ptr<song_cache::Entry> e, bool resume) {
+    Song& song = player::song();
+    std::unique_ptr<song_cache::Entry> cur;
+    if (!m_song_path.empty()) {
+        cur.reset(new song_cache::Entry());
+        cur->path = m_song_path;
+        cur->base = *m_base_song;
+    }
+
+    audio::pause(true);
+    if (cur) {
+        cur->song       = song;
+        cur->checkpoint = player::checkpoint();
+    }
+    song = e->song;
+    if (resume) player::restore(e->checkpoint);
+    audio::pause(false);
+
+    if (cur) song_cache::put(std::move(cur));
+    m_song_path  = e->path;
+    *m_base_song = e->base;
+    // the journal replays unsaved edits of a cached song on top of its file
+    journal::reset(m_song_path, *m_base_song);
+    history::reset(song);
+}
+
+
+// the status after a switch, reminding of edits that only live in the cache
+void switch_status(std::string msg) {
+    int n = song_cache::dirty_count();
+    if (n == 1) msg += ", 1 other song is unsaved";
+    if (n > 1)  msg += ", " + std::to_string(n) + " other songs are unsaved";
+    status(msg);
+}
+
+
+void new_song() {
+    std::unique_ptr<song_cache::Entry> e(new song_cache::Entry());
+    init_song(e->song);
+    e->base = e->song;
+    switch_song(std::move(e), false);
+    switch_status("Song was reset");
+}
+
+
+void load(std::string const& path) {
+    std::unique_ptr<song_cache::Entry> e = song_cache::take(path);
+    if (e) {
+        switch_song(std::move(e), true);
+        switch_status("Song was restored");
+        return;
+    }
+    e.reset(new song_cache::Entry());
+    e->path = path;
+    if (!load_song(e->song, path.c_str())) {
+        status("Load error: ?");
+        return;
+    }
+    e->base = e->song;
+    switch_song(std::move(e), false);
+    switch_status("Song was loaded");
+}
+
+
+int save_thread_func(void*) {
+    m_save_ok   = save_song(*m_save_song, m_save_path.c_str());
+    m_save_done = true;
+    return 0;
+}
+
+
 void save() {
-    std::string path = m_songs_dir + m_file_name.data() + FILE_SUFFIX;
-    if (!save_song(player::song(), path.c_str())) {
+    if (m_save_thread) {
+        status("Save error: still saving");
+        return;
+    }
+    // the thread works on a snapshot, so editing can go on
+    m_save_path = m_songs_dir + m_file_name.data() + FILE_SUFFIX;
+    m_save_song.reset(new Song(player::song()));
+    m_save_done   = false;
+    m_save_thread = SDL_CreateThread(save_thread_func, "song save", nullptr);
+}
+
+
+void poll_save() {
+    if (!m_save_thread || !m_save_done) return;
+    SDL_WaitThread(m_save_thread, nullptr);
+    m_save_thread = nullptr;
+    if (m_save_ok) {
+        // a cached version of the file is outdated now
+        song_cache::remove(m_save_path);
+        m_song_path  = m_save_path;
+        *m_base_song = *m_save_song;
+        journal::reset(m_save_path, *m_save_song);
+    }
+    m_save_song.reset();
+    if (!m_save_ok) {
         status("Save error: ?");
     }
     else {
@@ -279,6 +338,15 @@ void save() {
 }
 
 
+// tell once when the journal stops keeping up, and again once it has recovered
+void poll_journal() {
+    if (journal::failed() == m_journal_failed) return;
+    m_journal_failed = journal::failed();
+    if (m_journal_failed) status("Journal error: recent edits are not backed up");
+    else                  status("Journal is written again");
+}
+
+
 void draw_confirmation() {
     const char* text;
     switch (m_confirmation_type) {
@@ -301,10 +369,11 @@ void draw_confirmation() {
     auto widths = calculate_column_widths({ -1, -1 });
     gui::min_item_size({ widths[0], BUTTON_BIG });
     if (gui::button("OK")) {
-        std::string path = m_songs_dir + m_file_name.data() + FILE_SUFFIX;
+        std::string path = song_path(m_file_name.data());
         switch (m_confirmation_type) {
         case CT_DELETE:
             unlink(path.c_str());
+            song_cache::remove(path);
             init_project_view();
             status("Song was deleted");
             break;
@@ -312,12 +381,10 @@ void draw_confirmation() {
             save();
             break;
         case CT_NEW:
-            init_song(player::song());
-            status("Song was reset");
+            new_song();
             break;
         case CT_LOAD:
-            if (!load_song(player::song(), path.c_str())) status("Load error: ?");
-            else status("Song was loaded");
+            load(path);
             break;
         }
         edit::set_popup(nullptr);
@@ -331,12 +398,31 @@ void draw_confirmation() {
 void init_confirmation(ConfirmationType t) {
     std::string name = m_file_name.data();
     if (t == CT_LOAD || t == CT_DELETE) {
-        if (std::find(m_file_names.begin(), m_file_names.end(), name) == m_file_names.end()) {
+        if (std::none_of(m_entries.begin(), m_entries.end(), [&name](library::Entry const& e) { return e.name == name; })) {
             if (t == CT_LOAD) status("Load error: song not listed");
             else              status("Delete error: song not listed");
             return;
         }
     }
+    if (m_save_thread && t != CT_SAVE) {
+        // the finished save rebinds the current song to the saved file
+        status("Error: still saving");
+        return;
+    }
+    if (t == CT_NEW || t == CT_LOAD) {
+        // songs with a file go into the cache, which never drops unsaved edits,
+        // so only an unsaved new song can get lost
+        if (!m_song_path.empty() || !is_dirty()) {
+            if (t == CT_NEW) new_song();
+            else load(song_path(name));
+            return;
+        }
+    }
+    if (is_in_pack(name) && (t == CT_SAVE || t == CT_DELETE)) {
+        if (t == CT_SAVE) status("Save error: packs are read-only");
+        else              status("Delete error: packs are read-only");
+        return;
+    }
     if (t == CT_SAVE) {
         if (name.empty()) {
             status("Save error: empty song name");
@@ -365,29 +451,42 @@ void init_project_view() {
     if (!init_dirs_done) {
         init_dirs();
         init_dirs_done = true;
-    }
-
-    m_file_names.clear();
-    if (DIR* dir = opendir(m_songs_dir.c_str())) {
 
-        while (struct dirent* ent = readdir(dir)) {
-            if (ent->d_type == DT_REG) {
-                std::string name = ent->d_name;
-                if (name.size() > 4 && name.substr(name.size() - 4) == FILE_SUFFIX) {
-                    m_file_names.emplace_back(name.substr(0, name.size() - 4));
-                }
-            }
+        // recover unsaved changes
+        std::string base;
+        m_base_song.reset(new Song(player::song()));
+        if (journal::init(m_root_dir + "/journal", player::song(), base)) {
+            std::string name = song_name(base);
+            strncpy(m_file_name.data(), name.c_str(), m_file_name.size() - 1);
+            m_song_path = base;
+            if (!base.empty()) load_song(*m_base_song, base.c_str());
         }
-        closedir(dir);
-        std::sort(m_file_names.begin(), m_file_names.end());
+
+        library::init(m_songs_dir, m_root_dir + "/library");
+        preview::init(m_root_dir + "/previews/");
+        render_cache::init(m_root_dir + "/renders/", RENDER_CACHE_BUDGET);
     }
 
+    library::refresh();
+
     m_status_msg = "";
 }
 
 
+void free_project_view() {
+    audio::audition(nullptr);
+    preview::free();
+    library::free();
+    render_cache::free();
+}
+
+
 void draw_project_view() {
 
+    poll_save();
+    poll_journal();
+    if (library::poll(m_entries) || m_filter != m_search.data()) update_visible();
+
     Song& song = player::song();
 
     // title and author
@@ -429,7 +528,7 @@ void draw_project_view() {
     gui::same_line();
     gfx::font(FONT_MONO);
     gui::min_item_size({ widths[1], BUTTON_BIG });
-    int frames = (song.track_length * song.tempo + song.track_length / 2 * song.swing) * song.table_length;
+    int frames = song_frame_count(song);
     int seconds = frames / FRAMES_PER_SECOND;
     gui::text("%d:%02d", seconds / 60, seconds % 60);
 
@@ -450,30 +549,62 @@ void draw_project_view() {
     gui::input_text(m_file_name.data(), m_file_name.size() - 1);
     gui::separator();
 
+    // search by name, title or author
+    widths = calculate_column_widths({ 270, -1 });
+    gui::align(gui::LEFT);
+    gui::min_item_size({ widths[0], BUTTON_SMALL });
+    gui::text("Search");
+    gui::same_line();
+    gui::min_item_size({ widths[1], BUTTON_SMALL });
+    gui::input_text(m_search.data(), m_search.size() - 1);
+    gui::separator();
+
     // file select
-    enum { PAGE_LENGTH = 10 };
-    int max_scroll = std::max<int>(0, m_file_names.size() - PAGE_LENGTH);
+    enum { PAGE_LENGTH = 9, THUMBNAIL_WIDTH = 2 * preview::THUMBNAIL_SIZE };
+    int max_scroll = std::max<int>(0, m_visible.size() - PAGE_LENGTH);
     if (m_file_scroll > max_scroll) m_file_scroll = max_scroll;
     gui::same_line();
     Vec c1 = gui::cursor() + Vec(-BUTTON_SMALL - gui::PADDING, + gui::PADDING + gui::SEPARATOR_WIDTH);
     gui::next_line();
     gfx::font(FONT_DEFAULT);
-    widths = calculate_column_widths({ -1, gui::SEPARATOR_WIDTH, BUTTON_SMALL });
+    widths = calculate_column_widths({ -1, THUMBNAIL_WIDTH, gui::SEPARATOR_WIDTH, BUTTON_SMALL });
+    bool auditioning = m_audition_hash && SDL_GetTicks() < m_audition_end;
     for (int i = 0; i < PAGE_LENGTH; ++i) {
         int nr = i + m_file_scroll;
         gui::min_item_size({ widths[0], BUTTON_SMALL });
-        if (nr < (int) m_file_names.size()) {
-            bool select = strcmp(m_file_names[nr].c_str(), m_file_name.data()) == 0;
-            if (gui::button(m_file_names[nr].c_str(), select)) {
-                strncpy(m_file_name.data(), m_file_names[nr].c_str(), m_file_name.size());
+        if (nr < (int) m_visible.size()) {
+            library::Entry const& e = m_entries[m_visible[nr]];
+            bool select = e.name == m_file_name.data();
+            std::string label = e.title.empty() || e.title == e.name ? e.name : e.name + " - " + e.title;
+            if (gui::button(label.c_str(), select)) {
+                strncpy(m_file_name.data(), e.name.c_str(), m_file_name.size() - 1);
+            }
+
+            // tap the thumbnail to listen to the beginning of the song
+            auto p = e.hash ? preview::get(song_path(e.name), e.hash) : nullptr;
+            bool playing = auditioning && m_audition_hash == e.hash;
+            gui::same_line();
+            gui::min_item_size({ widths[1], BUTTON_SMALL });
+            if (gui::waveform(p ? p->thumbnail.data() : nullptr, preview::THUMBNAIL_SIZE, playing) && p) {
+                if (playing) {
+                    audio::audition(nullptr);
+                    m_audition_hash = 0;
+                }
+                else {
+                    audio::audition(std::shared_ptr<std::vector<short> const>(p, &p->snippet));
+                    m_audition_hash = e.hash;
+                    m_audition_end  = SDL_GetTicks() + p->snippet.size() * 1000 / preview::SNIPPET_RATE;
+                }
             }
         }
         else {
             gui::padding({});
+            gui::same_line();
+            gui::padding({ widths[1], 0 });
         }
         gui::same_line();
         gui::separator();
-        gui::padding({ widths[2], 0 });
+        gui::padding({ widths[3], 0 });
     }
     gui::align(gui::CENTER);
 
@@ -502,7 +633,7 @@ void draw_project_view() {
     gui::separator();
 
 
-    widths = calculate_column_widths({ widths2[0], -1, -1, gui::SEPARATOR_WIDTH, -1 });
+    widths = calculate_column_widths({ widths2[0], -1, -1, -1, -1, gui::SEPARATOR_WIDTH, -1 });
 
     gui::min_item_size({ widths2[0], BUTTON_BIG });
     gui::align(gui::LEFT);
@@ -510,15 +641,16 @@ void draw_project_view() {
     gui::align(gui::CENTER);
     gui::same_line();
 
-    gui::min_item_size({ widths[1], BUTTON_BIG });
-    if (gui::button("OGG", m_export_format == EF_OGG)) m_export_format = EF_OGG;
-    gui::same_line();
-    gui::min_item_size({ widths[2], BUTTON_BIG });
-    if (gui::button("WAV", m_export_format == EF_WAV)) m_export_format = EF_WAV;
-    gui::same_line();
+    // any number of formats can be exported at once
+    char const* format_names[] = { "OGG", "WAV", "FLAC", "Stems" };
+    for (int f = exporter::OGG; f <= exporter::STEMS; ++f) {
+        gui::min_item_size({ widths[1 + f], BUTTON_BIG });
+        if (gui::button(format_names[f], m_export_formats & 1 << f)) m_export_formats ^= 1 << f;
+        gui::same_line();
+    }
     gui::separator();
 
-    gui::min_item_size({ widths[4], BUTTON_BIG });
+    gui::min_item_size({ widths[6], BUTTON_BIG });
     if (gui::button("Export")) init_export();
     gui::separator();
 
@@ -526,7 +658,13 @@ void draw_project_view() {
     widths = calculate_column_widths({ -1 });
     gui::min_item_size({ widths[0], BUTTON_BIG });
     gui::align(gui::LEFT);
-    gui::text(m_status_msg.c_str());
+    if (!m_status_msg.empty()) gui::text(m_status_msg.c_str());
+    else {
+        // show how close the audio gets to its deadline
+        audio::Stats stats = audio::stats();
+        gui::text("CPU %d%%  peak %d%%  synth %d%%  xruns %d",
+                  int(stats.load), int(stats.peak_load), int(stats.render_load), stats.underruns);
+    }
     gui::align(gui::CENTER);
     if (++m_status_age > 100) m_status_msg = "";
 }
@@ -1,4 +1,5 @@
 #pragma once
 
 void init_project_view();
+void free_project_view();
 void draw_project_view();
@@ -0,0 +1,158 @@
+#include "render_cache.hpp"
+#include "player.hpp"
+#include "file.hpp"
+#include <SDL.h>
+#include <cinttypes>
+#include <ctime>
+#include <map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace render_cache {
+namespace {
+
+
+// the files are stored as they were exported, named by their key.
+// the modification time is the time of last use, so the order survives restarts
+
+enum { VERSION = 1 };
+
+
+struct Entry {
+    uint64_t size;
+    uint64_t used;      // nanoseconds
+};
+
+
+std::string                 m_dir;
+uint64_t                    m_budget;
+SDL_mutex*                  m_mutex;
+std::map<uint64_t, Entry>   m_entries;
+uint64_t                    m_size;
+
+
+uint64_t nanoseconds(timespec const& t) {
+    return uint64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+
+uint64_t now() {
+    timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return nanoseconds(t);
+}
+
+
+std::string entry_path(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".rnd", key);
+    return m_dir + name;
+}
+
+
+void drop(std::map<uint64_t, Entry>::iterator it) {
+    unlink(entry_path(it->first).c_str());
+    m_size -= it->second.size;
+    m_entries.erase(it);
+}
+
+
+// `keep` stays, even if it alone is over budget
+void evict(uint64_t keep) {
+    while (m_size > m_budget) {
+        auto oldest = m_entries.end();
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->first == keep) continue;
+            if (oldest == m_entries.end() || it->second.used < oldest->second.used) oldest = it;
+        }
+        if (oldest == m_entries.end()) break;
+        SDL_Log("render cache: evicting %016" PRIx64, oldest->first);
+        drop(oldest);
+    }
+}
+
+
+} // namespace
+
+
+void init(std::string const& dir, uint64_t budget) {
+    free();
+    m_dir    = dir;
+    m_budget = budget;
+    m_mutex  = SDL_CreateMutex();
+    m_size   = 0;
+
+    struct stat st;
+    if (stat(m_dir.c_str(), &st) == -1) mkdir(m_dir.c_str(), 0700);
+    DIR* d = opendir(m_dir.c_str());
+    if (!d) return;
+    while (struct dirent* ent = readdir(d)) {
+        uint64_t key;
+        char     suffix[8];
+        if (sscanf(ent->d_name, "%16" SCNx64 ".%7s", &key, suffix) != 2 || strcmp(suffix, "rnd") != 0) continue;
+        if (stat((m_dir + ent->d_name).c_str(), &st) == -1) continue;
+        m_entries[key] = { uint64_t(st.st_size), nanoseconds(st.st_mtim) };
+        m_size += st.st_size;
+    }
+    closedir(d);
+    evict(0);
+}
+
+
+void free() {
+    if (!m_mutex) return;
+    SDL_DestroyMutex(m_mutex);
+    m_mutex = nullptr;
+    m_entries.clear();
+}
+
+
+uint64_t key(Song const& song, std::string const& options) {
+    std::vector<uint8_t> data;
+    save_song(song, data);
+    uint32_t versions[] = { VERSION, ENGINE_VERSION };
+    data.insert(data.end(), (uint8_t const*) versions, (uint8_t const*) (versions + 2));
+    data.insert(data.end(), options.begin(), options.end());
+    return file::hash(data.data(), data.size());
+}
+
+
+bool fetch(uint64_t key, std::string const& path) {
+    if (!m_mutex) return false;
+    SDL_LockMutex(m_mutex);
+    bool ok = false;
+    auto it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        std::string src = entry_path(key);
+        ok = file::copy_atomic(src, path);
+        // gone or unreadable, e.g. evicted by another process sharing the directory
+        if (!ok) drop(it);
+        else {
+            it->second.used = now();
+            utimensat(AT_FDCWD, src.c_str(), nullptr, 0);
+        }
+    }
+    SDL_UnlockMutex(m_mutex);
+    return ok;
+}
+
+
+void store(uint64_t key, std::string const& path) {
+    if (!m_mutex) return;
+    SDL_LockMutex(m_mutex);
+    struct stat st;
+    auto it = m_entries.find(key);
+    if (it == m_entries.end() && stat(path.c_str(), &st) == 0 && file::copy_atomic(path, entry_path(key))) {
+        m_entries[key] = { uint64_t(st.st_size), now() };
+        m_size += st.st_size;
+        evict(key);
+    }
+    SDL_UnlockMutex(m_mutex);
+}
+
+
+} // namespace
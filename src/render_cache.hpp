@@ -0,0 +1,21 @@
+#pragma once
+#include "song.hpp"
+#include <string>
+#include <cstdint>
+
+
+// exported files kept by a hash of the song data, the engine version and the render options,
+// so a song that did not change is copied instead of rendered again.
+// the least recently used files are evicted when the cache grows beyond its budget
+namespace render_cache {
+    // nothing is cached before init
+    void     init(std::string const& dir, uint64_t budget);
+    void     free();
+
+    // `options` describes everything besides the song that changes the file
+    uint64_t key(Song const& song, std::string const& options);
+
+    // copy the file stored under `key` to `path`
+    bool     fetch(uint64_t key, std::string const& path);
+    void     store(uint64_t key, std::string const& path);
+}
@@ -0,0 +1,71 @@
+#include "resampler.hpp"
+#include <algorithm>
+
+
+// positions are 32.32 fixed point. position 0 is the first sample after `last`,
+// which is the carried sample if there is one
+
+
+namespace {
+
+
+// apart from the index there is no dependency between output samples. gcc vectorizes
+// this with -ftree-vectorize, but the emulated gathers made it slower than the scalar
+// loop, with avx2 too. fakesid-cli resample measures it
+void interpolate(float const* __restrict base, float* __restrict out, uint64_t pos, uint64_t step, int length) {
+    constexpr float frac_scale = 1.0f / 4294967296.0f;
+    for (int j = 0; j < length; ++j) {
+        uint64_t p = pos + step * j;
+        int      i = int(p >> 32);
+        float    f = uint32_t(p) * frac_scale;
+        float    a = base[i - 1];
+        float    b = base[i];
+        out[j] = a + (b - a) * f;
+    }
+}
+
+
+} // namespace
+
+
+void Resampler::init(int src_rate, int dst_rate, int max_length) {
+    step    = (uint64_t(src_rate) << 32) / dst_rate;
+    pos     = 0;
+    last    = 0;
+    tail    = 0;
+    carried = 0;
+    input.resize(2 + input_length(max_length) + 1);
+}
+
+
+int Resampler::input_length(int length) const {
+    if (length <= 0) return 0;
+    // when upsampling, the last output sample may need one sample more than the
+    // position moves on by. that one is carried over to the next call
+    int needed   = int((pos + step * (length - 1)) >> 32) + 1;
+    int consumed = int((pos + step * length) >> 32);
+    return std::max(needed, consumed) - carried;
+}
+
+
+void Resampler::process(short const* in, float* out, int length) {
+    if (length <= 0) return;
+    constexpr float scale = 1.0f / 32768;
+
+    int n = input_length(length);
+    if ((int) input.size() < n + 2) input.resize(n + 2);
+    float* base = input.data() + 1;
+    base[-1] = last;
+    base[0]  = tail;
+    for (int i = 0; i < n; ++i) base[carried + i] = in[i] * scale;
+
+    interpolate(base, out, pos, step, length);
+
+    int available = carried + n;
+    pos += step * length;
+    int consumed = int(pos >> 32);
+    pos &= 0xffffffff;
+    last    = base[consumed - 1];
+    carried = available - consumed;
+    tail    = base[consumed];
+}
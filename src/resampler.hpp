@@ -0,0 +1,23 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+
+// linear interpolating sample rate converter
+struct Resampler {
+    // `max_length` is the most output samples a call produces
+    void init(int src_rate, int dst_rate, int max_length);
+
+    // number of new input samples needed to produce `length` output samples
+    int  input_length(int length) const;
+
+    // `in` must hold input_length(length) samples
+    void process(short const* in, float* out, int length);
+
+    uint64_t           step;
+    uint64_t           pos;
+    float              last;        // the input sample before the current position
+    float              tail;        // taken last time but not consumed yet
+    int                carried;     // 1 if tail is valid
+    std::vector<float> input;       // last, tail and the new samples
+};
@@ -1,9 +1,132 @@
 #include "song.hpp"
+#include "file.hpp"
+#include "pack.hpp"
 #include <SDL.h>
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <unordered_map>
+
+
+// all song data is made of bytes, so the in-memory layout is also the file layout
+static_assert(sizeof(Track)      == MAX_TRACK_LENGTH * 3, "");
+static_assert(sizeof(Instrument) == 23 + MAX_INSTRUMENT_LENGTH * 3 + 3 + MAX_FILTER_LENGTH * 4, "");
+static_assert(sizeof(Effect)     == 18 + MAX_EFFECT_LENGTH * 2, "");
+static_assert(offsetof(SongMeta, track_length) == 2 + 32 + 32 + 2, "");
+
+
+namespace {
+
+// the largest chunk, read for items a song does not hold
+constexpr uint8_t zero_chunk[sizeof(Instrument)] = {};
+
+template<class T>
+void grow(std::vector<T>& items, int count) {
+    if ((int) items.size() < count) items.resize(count);
+}
+
+} // namespace
+
+
+int chunk_count(Song const& song, ChunkType type) {
+    switch (type) {
+    case CHUNK_META:       return 1;
+    case CHUNK_BLOCK:      return song.table.size();
+    case CHUNK_TRACK:      return song.tracks.size();
+    case CHUNK_INSTRUMENT: return song.instruments.size();
+    case CHUNK_EFFECT:     return song.effects.size();
+    default:               return 0;
+    }
+}
+
+
+int chunk_max_count(ChunkType type) {
+    switch (type) {
+    case CHUNK_META:       return 1;
+    case CHUNK_BLOCK:      return MAX_SONG_LENGTH;
+    case CHUNK_TRACK:      return TRACK_COUNT;
+    case CHUNK_INSTRUMENT: return INSTRUMENT_COUNT;
+    case CHUNK_EFFECT:     return EFFECT_COUNT;
+    default:               return 0;
+    }
+}
+
+
+int chunk_size(ChunkType type) {
+    switch (type) {
+    case CHUNK_META:       return offsetof(SongMeta, track_length) + 1;
+    case CHUNK_BLOCK:      return sizeof(Song::Block);
+    case CHUNK_TRACK:      return sizeof(Track);
+    case CHUNK_INSTRUMENT: return sizeof(Instrument);
+    case CHUNK_EFFECT:     return sizeof(Effect);
+    default:               return 0;
+    }
+}
+
+
+uint8_t const* chunk_data(Song const& song, ChunkType type, int index) {
+    if (index >= chunk_count(song, type)) return zero_chunk;
+    switch (type) {
+    case CHUNK_META:       return (uint8_t const*) (SongMeta const*) &song;
+    case CHUNK_BLOCK:      return song.table[index].data();
+    case CHUNK_TRACK:      return (uint8_t const*) &song.tracks[index];
+    case CHUNK_INSTRUMENT: return (uint8_t const*) &song.instruments[index];
+    case CHUNK_EFFECT:     return (uint8_t const*) &song.effects[index];
+    default:               return nullptr;
+    }
+}
+
+
+uint8_t* chunk_data(Song& song, ChunkType type, int index) {
+    assert(index < chunk_count(song, type));
+    return (uint8_t*) chunk_data((Song const&) song, type, index);
+}
+
+
+void grow_song(Song& song, ChunkType type, int count) {
+    count = std::min(count, chunk_max_count(type));
+    switch (type) {
+    case CHUNK_BLOCK:      grow(song.table, count); break;
+    case CHUNK_TRACK:      grow(song.tracks, count); break;
+    case CHUNK_INSTRUMENT: grow(song.instruments, count); break;
+    case CHUNK_EFFECT:     grow(song.effects, count); break;
+    default:               break;
+    }
+}
+
+
+void reserve_song(Song& song) {
+    song.table.reserve(MAX_SONG_LENGTH);
+    song.tracks.reserve(TRACK_COUNT);
+    song.instruments.reserve(INSTRUMENT_COUNT);
+    song.effects.reserve(EFFECT_COUNT);
+}
+
+
+bool songs_equal(Song const& a, Song const& b) {
+    for (int t = 0; t < CHUNK_TYPE_COUNT; ++t) {
+        ChunkType type = ChunkType(t);
+        int n = std::max(chunk_count(a, type), chunk_count(b, type));
+        for (int i = 0; i < n; ++i) {
+            if (memcmp(chunk_data(a, type, i), chunk_data(b, type, i), chunk_size(type)) != 0) return false;
+        }
+    }
+    return true;
+}
+
+
+int song_frame_count(Song const& song) {
+    return (song.track_length * song.tempo + song.track_length / 2 * song.swing) * song.table_length;
+}
 
 
 void init_song(Song& song) {
-    memset(&song, 0, sizeof(song));
+    // assign in place, so the song keeps its reserved capacity
+    (SongMeta&) song = {};
+    song.tracks.clear();
+    song.instruments.assign(1, {});
+    song.effects.assign(EFFECT_COUNT, {});
+    song.table.assign(1, {});
 
     song.tempo = 8;
     song.track_length = 32;
@@ -62,38 +185,411 @@ void init_song(Song& song) {
 }
 
 
-bool load_song(Song& song, char const* name) {
-    SDL_RWops* file = SDL_RWFromFile(name, "rb");
-    if (!file) return false;
-    SDL_RWread(file, song.title.data(), sizeof(char), song.title.size());
-    SDL_RWread(file, song.author.data(), sizeof(char), song.author.size());
-    song.tempo = SDL_ReadU8(file);
-    song.swing = SDL_ReadU8(file);
-    song.track_length = SDL_ReadU8(file);
-    SDL_RWread(file, song.tracks.data(), sizeof(Track), song.tracks.size());
-    SDL_RWread(file, song.instruments.data(), sizeof(Instrument), song.instruments.size());
-    SDL_RWread(file, song.effects.data(), sizeof(Effect), song.effects.size());
-    song.table_length = SDL_ReadLE16(file);
-    song.table = {};
-    SDL_RWread(file, song.table.data(), sizeof(Song::Block), song.table_length);
-    SDL_RWclose(file);
+namespace {
+
+
+// file format:
+//
+//   magic "\x89FSNG", u16 version
+//   chunks: 4 byte tag, u32 length, payload
+//
+//   HEAD  title[32] author[32] tempo swing track_length u16 table_length
+//   TABL  table_length blocks
+//   TRAK  u16 index, rle data   (one chunk per non-empty track)
+//   INST  u16 index, rle data   (one chunk per non-empty instrument)
+//   EFCT  u16 index, rle data   (one chunk per non-empty effect)
+//   TALI  u16 index, u16 source (a track identical to an earlier stored one, since version 2)
+//
+// numbers are little-endian, unknown chunks are skipped.
+// rle: a zero byte is followed by the length of the zero run, all other bytes are literals.
+//
+// the legacy format is a raw dump of all tracks, instruments and effects.
+
+constexpr char MAGIC[]      = "\x89" "FSNG";
+constexpr int  MAGIC_LENGTH = sizeof(MAGIC) - 1;
+enum {
+    VERSION       = 2,
+    // files without track aliases stay readable by older versions
+    VERSION_PLAIN = 1,
+};
+
+
+struct Writer {
+    std::vector<uint8_t>& data;
+
+    void u8(uint8_t v) { data.push_back(v); }
+    void u16(uint16_t v) { u8(v); u8(v >> 8); }
+    void u32(uint32_t v) { u16(v); u16(v >> 16); }
+    void bytes(void const* p, size_t len) {
+        data.insert(data.end(), (uint8_t const*) p, (uint8_t const*) p + len);
+    }
+
+    size_t begin_chunk(char const* tag) {
+        bytes(tag, 4);
+        u32(0);
+        return data.size();
+    }
+    void end_chunk(size_t start) {
+        uint32_t len = data.size() - start;
+        for (int i = 0; i < 4; ++i) data[start - 4 + i] = len >> i * 8;
+    }
+
+    void rle(void const* p, size_t len) {
+        uint8_t const* src = (uint8_t const*) p;
+        for (size_t i = 0; i < len;) {
+            if (src[i]) {
+                u8(src[i++]);
+                continue;
+            }
+            int n = 0;
+            while (i < len && src[i] == 0 && n < 255) {
+                ++i;
+                ++n;
+            }
+            u8(0);
+            u8(n);
+        }
+    }
+};
+
+
+struct Reader {
+    uint8_t const* pos;
+    uint8_t const* end;
+    bool           ok = true;
+
+    size_t   left() const { return end - pos; }
+    uint8_t  u8() {
+        if (pos >= end) {
+            ok = false;
+            return 0;
+        }
+        return *pos++;
+    }
+    uint16_t u16() { uint16_t v = u8(); return v | u8() << 8; }
+    uint32_t u32() { uint32_t v = u16(); return v | uint32_t(u16()) << 16; }
+    void     bytes(void* p, size_t len) {
+        if (left() < len) {
+            ok = false;
+            return;
+        }
+        memcpy(p, pos, len);
+        pos += len;
+    }
+
+    bool rle(void* p, size_t len) {
+        uint8_t* dst = (uint8_t*) p;
+        for (size_t i = 0; i < len && ok;) {
+            uint8_t b = u8();
+            if (b) {
+                dst[i++] = b;
+                continue;
+            }
+            int n = u8();
+            if (n == 0 || i + n > len) return ok = false;
+            memset(dst + i, 0, n);
+            i += n;
+        }
+        return ok;
+    }
+};
+
+
+template<class T>
+bool is_empty(T const& t) {
+    uint8_t const* p = (uint8_t const*) &t;
+    return std::all_of(p, p + sizeof(T), [](uint8_t b) { return b == 0; });
+}
+
+
+template<class T>
+void write_items(Writer& w, char const* tag, std::vector<T> const& items, std::vector<bool> const& skip = {}) {
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (is_empty(items[i]) || (!skip.empty() && skip[i])) continue;
+        size_t c = w.begin_chunk(tag);
+        w.u16(i);
+        w.rle(&items[i], sizeof(T));
+        w.end_chunk(c);
+    }
+}
+
+
+template<class T>
+bool read_item(Reader& r, std::vector<T>& items, int max_count) {
+    int i = r.u16();
+    if (!r.ok || i >= max_count) return r.ok = false;
+    grow(items, i + 1);
+    return r.rle(&items[i], sizeof(T));
+}
+
+
+bool load_chunked(Song& song, Reader& r) {
+    r.pos += MAGIC_LENGTH;
+    int version = r.u16();
+    if (!r.ok || version > VERSION) return false;
+
+    while (r.ok && r.left() > 0) {
+        char tag[4];
+        r.bytes(tag, 4);
+        uint32_t len = r.u32();
+        if (!r.ok || len > r.left()) return false;
+        Reader c = { r.pos, r.pos + len };
+        r.pos += len;
+
+        if (memcmp(tag, "HEAD", 4) == 0) {
+            c.bytes(song.title.data(), song.title.size());
+            c.bytes(song.author.data(), song.author.size());
+            song.tempo        = c.u8();
+            song.swing        = c.u8();
+            song.track_length = c.u8();
+            song.table_length = c.u16();
+            if (song.table_length > MAX_SONG_LENGTH) return false;
+        }
+        else if (memcmp(tag, "TABL", 4) == 0) {
+            int n = std::min<int>(len / sizeof(Song::Block), MAX_SONG_LENGTH);
+            song.table.resize(n);
+            c.bytes(song.table.data(), n * sizeof(Song::Block));
+        }
+        else if (memcmp(tag, "TRAK", 4) == 0) read_item(c, song.tracks, TRACK_COUNT);
+        else if (memcmp(tag, "TALI", 4) == 0) {
+            int i   = c.u16();
+            int src = c.u16();
+            if (!c.ok || i >= TRACK_COUNT || src >= (int) song.tracks.size()) return false;
+            grow(song.tracks, i + 1);
+            song.tracks[i] = song.tracks[src];
+        }
+        else if (memcmp(tag, "INST", 4) == 0) read_item(c, song.instruments, INSTRUMENT_COUNT);
+        else if (memcmp(tag, "EFCT", 4) == 0) read_item(c, song.effects, EFFECT_COUNT);
+        if (!c.ok) return false;
+    }
+    return r.ok;
+}
+
+
+bool load_legacy(Song& song, Reader& r) {
+    r.bytes(song.title.data(), song.title.size());
+    r.bytes(song.author.data(), song.author.size());
+    song.tempo        = r.u8();
+    song.swing        = r.u8();
+    song.track_length = r.u8();
+    song.tracks.resize(TRACK_COUNT);
+    song.instruments.resize(INSTRUMENT_COUNT);
+    song.effects.resize(EFFECT_COUNT);
+    r.bytes(song.tracks.data(), sizeof(Track) * song.tracks.size());
+    r.bytes(song.instruments.data(), sizeof(Instrument) * song.instruments.size());
+    r.bytes(song.effects.data(), sizeof(Effect) * song.effects.size());
+    song.table_length = r.u16();
+    if (!r.ok || song.table_length > MAX_SONG_LENGTH) return false;
+    song.table.resize(song.table_length);
+    r.bytes(song.table.data(), sizeof(Song::Block) * song.table_length);
+    return r.ok;
+}
+
+
+template<class T>
+void clamp(T& v, int min, int max) {
+    v = std::max(min, std::min<int>(v, max));
+}
+
+
+// rows beyond the length are reset by the editor before they are shown
+void normalize_loop(uint8_t& length, uint8_t& loop, int max_length) {
+    clamp(length, 0, max_length);
+    clamp(loop, 0, std::max(0, length - 1));
+}
+
+
+void normalize_filter(Filter& filter) {
+    filter.routing &= (1 << CHANNEL_COUNT) - 1;
+    normalize_loop(filter.length, filter.loop, MAX_FILTER_LENGTH);
+    for (int i = 0; i < filter.length; ++i) {
+        Filter::Row& row = filter.rows[i];
+        row.type &= FILTER_LOW | FILTER_BAND | FILTER_HIGH;
+        clamp(row.resonance, 0, 15);
+        clamp(row.operation, Filter::OP_INC, Filter::OP_DEC);
+        clamp(row.value, 0, 31);
+    }
+}
+
+
+void normalize_instrument(Instrument& inst) {
+    inst.name.back() = '\0';
+    for (uint8_t& v : inst.adsr) clamp(v, 0, 15);
+    inst.hard_restart = inst.hard_restart != 0;
+    normalize_loop(inst.length, inst.loop, MAX_INSTRUMENT_LENGTH);
+    for (int i = 0; i < inst.length; ++i) {
+        Instrument::Row& row = inst.rows[i];
+        clamp(row.operation, Instrument::OP_INC, Instrument::OP_SET);
+        clamp(row.value, 0, 31);
+    }
+    normalize_filter(inst.filter);
+}
+
+
+void normalize_effect(Effect& effect) {
+    effect.name.back() = '\0';
+    normalize_loop(effect.length, effect.loop, MAX_EFFECT_LENGTH);
+    for (int i = 0; i < effect.length; ++i) {
+        Effect::Row& row = effect.rows[i];
+        clamp(row.operation, Effect::OP_RELATIVE, Effect::OP_DETUNE);
+        if (row.operation == Effect::OP_ABSOLUTE) clamp(row.value, 0, 96);
+        else                                      clamp(row.value, 0x30 - 24, 0x30 + 24);
+    }
+}
+
+
+template<class T>
+void trim(std::vector<T>& items, int max_count) {
+    if ((int) items.size() > max_count) items.resize(max_count);
+    while (!items.empty() && is_empty(items.back())) items.pop_back();
+}
+
+
+void normalize_track(Track& track) {
+    for (Track::Row& row : track.rows) {
+        if (row.instrument > INSTRUMENT_COUNT) row.instrument = 0;
+        if (row.effect > EFFECT_COUNT) row.effect = 0;
+        if (row.note > 96 && row.note != 255) row.note = 0;
+    }
+}
+
+
+} // namespace
+
+
+std::vector<std::vector<int>> find_duplicate_tracks(Song const& song) {
+    // group by content hash, then make sure the bytes really match
+    std::unordered_map<uint64_t, std::vector<int>> buckets;
+    for (int i = 0; i < (int) song.tracks.size(); ++i) {
+        Track const& t = song.tracks[i];
+        if (is_empty(t)) continue;
+        buckets[file::hash(&t, sizeof(Track))].push_back(i);
+    }
+    std::vector<std::vector<int>> groups;
+    for (auto& b : buckets) {
+        std::vector<int>& bucket = b.second;
+        while (bucket.size() > 1) {
+            std::vector<int> group;
+            std::vector<int> rest;
+            for (int i : bucket) {
+                if (memcmp(&song.tracks[i], &song.tracks[bucket[0]], sizeof(Track)) == 0) group.push_back(i);
+                else rest.push_back(i);
+            }
+            if (group.size() > 1) groups.push_back(std::move(group));
+            bucket.swap(rest);
+        }
+    }
+    std::sort(groups.begin(), groups.end());
+    return groups;
+}
+
+
+int merge_duplicate_tracks(Song& song) {
+    int freed = 0;
+    for (std::vector<int> const& group : find_duplicate_tracks(song)) {
+        for (size_t k = 1; k < group.size(); ++k) {
+            for (Song::Block& block : song.table) {
+                for (uint8_t& t : block) {
+                    if (t == group[k] + 1) t = group[0] + 1;
+                }
+            }
+            song.tracks[group[k]] = {};
+            ++freed;
+        }
+    }
+    return freed;
+}
+
+
+void normalize_song(Song& song) {
+    song.title.back()  = '\0';
+    song.author.back() = '\0';
+    clamp(song.tempo, 4, 16);
+    clamp(song.swing, 0, 8);
+    clamp(song.track_length, 1, MAX_TRACK_LENGTH);
+    clamp(song.table_length, 1, MAX_SONG_LENGTH);
+
+    for (Track& track : song.tracks) normalize_track(track);
+    for (Instrument& inst : song.instruments) normalize_instrument(inst);
+    for (Effect& effect : song.effects) normalize_effect(effect);
+
+    // resize in place, so the song keeps its reserved capacity
+    trim(song.tracks, TRACK_COUNT);
+    trim(song.instruments, INSTRUMENT_COUNT);
+    trim(song.effects, EFFECT_COUNT);
+    song.table.resize(song.table_length);
+    for (Song::Block& block : song.table) {
+        for (uint8_t& t : block) {
+            if (t > TRACK_COUNT) t = 0;
+        }
+    }
+}
+
+
+bool load_song(Song& song, uint8_t const* data, size_t size) {
+    std::unique_ptr<Song> tmp(new Song());
+    Reader r = { data, data + size };
+    bool ok = size >= MAGIC_LENGTH && memcmp(data, MAGIC, MAGIC_LENGTH) == 0
+            ? load_chunked(*tmp, r)
+            : load_legacy(*tmp, r);
+    if (!ok) return false;
+    normalize_song(*tmp);
+    song = *tmp;
     return true;
 }
 
 
+void save_song(Song const& song, std::vector<uint8_t>& data) {
+    // identical tracks are stored once
+    std::vector<bool>                     is_alias(song.tracks.size());
+    std::vector<std::pair<int, int>>      aliases;
+    for (std::vector<int> const& group : find_duplicate_tracks(song)) {
+        for (size_t k = 1; k < group.size(); ++k) {
+            is_alias[group[k]] = true;
+            aliases.emplace_back(group[k], group[0]);
+        }
+    }
+
+    data.clear();
+    Writer w = { data };
+    w.bytes(MAGIC, MAGIC_LENGTH);
+    w.u16(aliases.empty() ? VERSION_PLAIN : VERSION);
+
+    size_t c = w.begin_chunk("HEAD");
+    w.bytes(song.title.data(), song.title.size());
+    w.bytes(song.author.data(), song.author.size());
+    w.u8(song.tempo);
+    w.u8(song.swing);
+    w.u8(song.track_length);
+    w.u16(song.table_length);
+    w.end_chunk(c);
+
+    c = w.begin_chunk("TABL");
+    w.bytes(song.table.data(), sizeof(Song::Block) * song.table_length);
+    w.end_chunk(c);
+
+    write_items(w, "TRAK", song.tracks, is_alias);
+    write_items(w, "INST", song.instruments);
+    write_items(w, "EFCT", song.effects);
+
+    // after all tracks, so the sources are loaded first
+    for (auto const& a : aliases) {
+        c = w.begin_chunk("TALI");
+        w.u16(a.first);
+        w.u16(a.second);
+        w.end_chunk(c);
+    }
+}
+
+
+bool load_song(Song& song, char const* name) {
+    std::vector<uint8_t> data;
+    return pack::read(name, data) && load_song(song, data.data(), data.size());
+}
+
+
 bool save_song(Song const& song, char const* name) {
-    SDL_RWops* file = SDL_RWFromFile(name, "wb");
-    if (!file) return false;
-    SDL_RWwrite(file, song.title.data(), sizeof(char), song.title.size());
-    SDL_RWwrite(file, song.author.data(), sizeof(char), song.author.size());
-    SDL_WriteU8(file, song.tempo);
-    SDL_WriteU8(file, song.swing);
-    SDL_WriteU8(file, song.track_length);
-    SDL_RWwrite(file, song.tracks.data(), sizeof(Track), song.tracks.size());
-    SDL_RWwrite(file, song.instruments.data(), sizeof(Instrument), song.instruments.size());
-    SDL_RWwrite(file, song.effects.data(), sizeof(Effect), song.effects.size());
-    SDL_WriteLE16(file, song.table_length);
-    SDL_RWwrite(file, song.table.data(), sizeof(Song::Block), song.table_length);
-    SDL_RWclose(file);
-    return true;
+    std::vector<uint8_t> data;
+    save_song(song, data);
+    return file::write_atomic(name, data.data(), data.size());
 }
@@ -1,7 +1,12 @@
 #pragma once
 #include <array>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
 
 
+// track, instrument and effect counts are the highest ids.
+// a song only holds items up to the last one in use
 enum {
     CHANNEL_COUNT         = 4,
     MAX_TRACK_LENGTH      = 32,
@@ -12,7 +17,7 @@ enum {
     MAX_FILTER_LENGTH     = 16,
     MAX_EFFECT_LENGTH     = 16,
     MAX_NAME_LENGTH       = 16,
-    MAX_SONG_LENGTH       = 256,
+    MAX_SONG_LENGTH       = 1024,
 };
 
 
@@ -102,23 +107,73 @@ struct Effect {
 };
 
 
-struct Song {
-    using Block = std::array<uint8_t, CHANNEL_COUNT>;
+struct SongMeta {
+    // table_length comes first, so that all fields form one chunk without padding
+    uint16_t             table_length;
 
-    std::array<char, 32>                     title;
-    std::array<char, 32>                     author;
+    std::array<char, 32> title;
+    std::array<char, 32> author;
 
     uint8_t tempo; // 4 to F
     uint8_t swing; // 0 to 4
     uint8_t track_length;
+};
 
-    std::array<Track, TRACK_COUNT>           tracks;
-    std::array<Instrument, INSTRUMENT_COUNT> instruments;
-    std::array<Effect, EFFECT_COUNT>         effects;
-    std::array<Block, MAX_SONG_LENGTH>       table;
-    uint16_t                                 table_length;
+
+// items are stored up to the highest one in use, ids beyond that refer to empty items.
+// the table holds at least table_length blocks
+struct Song : SongMeta {
+    using Block = std::array<uint8_t, CHANNEL_COUNT>;
+
+    std::vector<Track>      tracks;
+    std::vector<Instrument> instruments;
+    std::vector<Effect>     effects;
+    std::vector<Block>      table;
 };
 
+
+// the song as independent byte chunks, for diffing and journaling edits
+enum ChunkType {
+    CHUNK_META,         // table length, title, author, tempo, swing and track length
+    CHUNK_BLOCK,
+    CHUNK_TRACK,
+    CHUNK_INSTRUMENT,
+    CHUNK_EFFECT,
+
+    CHUNK_TYPE_COUNT
+};
+
+int            chunk_count(Song const& song, ChunkType type);
+int            chunk_max_count(ChunkType type);
+int            chunk_size(ChunkType type);
+uint8_t*       chunk_data(Song& song, ChunkType type, int index);
+// chunks the song does not hold read as zeros, up to the max count
+uint8_t const* chunk_data(Song const& song, ChunkType type, int index);
+
+// add empty items until the song holds `count` chunks of the type. it never shrinks.
+// the edited song reserves the max counts up front, so growing it does not move
+// the items the player points to
+void grow_song(Song& song, ChunkType type, int count);
+void reserve_song(Song& song);
+// items the songs do not hold count as empty
+bool songs_equal(Song const& a, Song const& b);
+
 void init_song(Song& song);
-bool load_song(Song& song, char const* name);
+int  song_frame_count(Song const& song);
+bool load_song(Song& song, char const* name); // also from a pack, see pack::read
 bool save_song(Song const& song, char const* name);
+
+// reads both the chunked format and the legacy raw dump.
+// the result is normalized, so the player can index with song data unchecked
+bool load_song(Song& song, uint8_t const* data, size_t size);
+void save_song(Song const& song, std::vector<uint8_t>& data);
+
+// groups of identical non-empty tracks, by track index (not the 1-based track number)
+std::vector<std::vector<int>> find_duplicate_tracks(Song const& song);
+// point all blocks to the first track of each group and clear the copies.
+// returns the number of tracks that were freed
+int merge_duplicate_tracks(Song& song);
+
+// clamp all ids, lengths and values into the ranges the player and editor expect,
+// and drop trailing empty items
+void normalize_song(Song& song);
@@ -0,0 +1,64 @@
+#include "song_cache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+
+namespace song_cache {
+namespace {
+
+
+// most recently used first
+std::deque<std::unique_ptr<Entry>> m_entries;
+
+
+auto find(std::string const& path) {
+    return std::find_if(m_entries.begin(), m_entries.end(), [&path](std::unique_ptr<Entry> const& e) {
+        return e->path == path;
+    });
+}
+
+
+} // namespace
+
+
+bool Entry::dirty() const {
+    return !songs_equal(song, base);
+}
+
+
+void put(std::unique_ptr<Entry> e) {
+    remove(e->path);
+    m_entries.push_front(std::move(e));
+    // evict the least recently used clean entries. unsaved edits are never dropped,
+    // the cache rather grows beyond its capacity
+    for (auto it = m_entries.end(); m_entries.size() > CAPACITY && it - m_entries.begin() > 1;) {
+        --it;
+        if (!(*it)->dirty()) it = m_entries.erase(it);
+    }
+}
+
+
+int dirty_count() {
+    return std::count_if(m_entries.begin(), m_entries.end(), [](std::unique_ptr<Entry> const& e) {
+        return e->dirty();
+    });
+}
+
+
+std::unique_ptr<Entry> take(std::string const& path) {
+    auto it = find(path);
+    if (it == m_entries.end()) return nullptr;
+    std::unique_ptr<Entry> e = std::move(*it);
+    m_entries.erase(it);
+    return e;
+}
+
+
+void remove(std::string const& path) {
+    auto it = find(path);
+    if (it != m_entries.end()) m_entries.erase(it);
+}
+
+
+} // namespace
@@ -0,0 +1,27 @@
+#pragma once
+#include "player.hpp"
+#include <string>
+#include <memory>
+
+
+// recently used songs kept in memory, so switching between them is instant
+// and keeps unsaved edits and the playback position
+namespace song_cache {
+    enum { CAPACITY = 4 };
+
+    struct Entry {
+        std::string        path;
+        Song               song;
+        Song               base;        // the song as it is on disk
+        Player::Checkpoint checkpoint;
+
+        bool dirty() const;
+    };
+
+    // the least recently used clean entry is dropped when full, dirty ones are always kept
+    void                   put(std::unique_ptr<Entry> e);
+    std::unique_ptr<Entry> take(std::string const& path);
+    void                   remove(std::string const& path);
+    // entries with unsaved edits
+    int                    dirty_count();
+}
@@ -3,6 +3,7 @@
 #include "edit.hpp"
 #include "gui.hpp"
 #include "player.hpp"
+#include "audio.hpp"
 #include <algorithm>
 #include <dirent.h>
 #include <unistd.h>
@@ -59,7 +60,7 @@ void draw_song_view() {
     auto& table = song.table;
 
     gfx::font(FONT_MONO);
-    int player_block = player::block();
+    int player_block = audio::playhead().block;
     for (int i = 0; i < PAGE_LENGTH; ++i) {
         int block_nr = m_song_scroll + i;
         bool highlight = block_nr == player_block;
@@ -133,6 +134,7 @@ void draw_song_view() {
     gui::min_item_size({ BUTTON_BIG, BUTTON_BIG });
     if (gui::button("+")) {
         if (m_block <= song.table_length && song.table_length < MAX_SONG_LENGTH) {
+            edit::grow_song(CHUNK_BLOCK, song.table_length + 1);
             std::rotate(
                 table.begin() + m_block,
                 table.begin() + song.table_length,
@@ -140,6 +142,12 @@ void draw_song_view() {
             ++song.table_length;
         }
     }
+
+    // let all blocks share one copy of identical tracks
+    gui::same_line();
+    gfx::font(FONT_DEFAULT);
+    gui::min_item_size({ 0, BUTTON_BIG });
+    if (gui::button("Merge duplicates")) merge_duplicate_tracks(song);
     gui::min_item_size({ gfx::screensize().x - gui::PADDING * 2, 0 });
     gui::separator();
 }
@@ -2,6 +2,8 @@
 #include "track_view.hpp"
 #include "gui.hpp"
 #include "player.hpp"
+#include "audio.hpp"
+#include "usage.hpp"
 #include <algorithm>
 
 namespace {
@@ -69,9 +71,8 @@ int      m_instrument = 1;
 int      m_effect     = 1;
 
 
-std::array<bool, TRACK_COUNT> m_empty_tracks;
-bool                          m_track_select_allow_nil;
-uint8_t*                      m_track_select_value;
+bool     m_track_select_allow_nil;
+uint8_t* m_track_select_value;
 
 
 void draw_track_select() {
@@ -109,7 +110,7 @@ void draw_track_select() {
             char str[3] = "  ";
             sprint_track_id(str, n);
 
-            if (!m_empty_tracks[n - 1]) gui::highlight();
+            if (!usage::is_track_empty(n)) gui::highlight();
             if (gui::button(str, n == track_nr)) {
                 *m_track_select_value = n;
                 edit::set_popup(nullptr);
@@ -123,17 +124,6 @@ void enter_track_select(uint8_t& dst, bool allow_nil) {
     edit::set_popup(draw_track_select);
     m_track_select_value = &dst;
     m_track_select_allow_nil = allow_nil;
-
-    Song const& song = player::song();
-    for (int i = 0; i < (int) m_empty_tracks.size(); ++i) {
-        m_empty_tracks[i] = true;
-        for (Track::Row const& row : song.tracks[i].rows) {
-            if (row.note || row.instrument || row.effect) {
-                m_empty_tracks[i] = false;
-                break;
-            }
-        }
-    }
 }
 
 
@@ -214,6 +204,7 @@ void draw_track_view() {
 
     assert(m_track > 0);
     Song& song = player::song();
+    edit::grow_song(CHUNK_TRACK, m_track);
     Track& track = song.tracks[m_track - 1];
 
     gui::same_line();
@@ -249,7 +240,7 @@ void draw_track_view() {
         PAGE_LENGTH = 16
     };
 
-    int player_row = player::row();
+    int player_row = audio::playhead().row;
     gfx::font(FONT_MONO);
     for (int i = 0; i < PAGE_LENGTH; ++i) {
         if (i % 4 == 0) gui::separator();
@@ -0,0 +1,109 @@
+#include "usage.hpp"
+
+
+namespace usage {
+namespace {
+
+
+// instruments or effects and where they are used
+template<int N>
+struct Users {
+    using ItemSet = std::bitset<N>;
+
+    std::array<ItemSet, TRACK_COUNT>                           track_items;
+    std::array<BlockSet, N>                                    blocks;
+    // number of channels per block that play a track using the item
+    std::array<std::array<uint8_t, MAX_SONG_LENGTH>, N>        block_refs;
+
+    void add_block_ref(int t, int b, int delta) {
+        ItemSet const& items = track_items[t];
+        for (int i = 0; i < N; ++i) {
+            if (!items[i]) continue;
+            block_refs[i][b] += delta;
+            blocks[i][b] = block_refs[i][b] > 0;
+        }
+    }
+
+    void set_track_items(int t, ItemSet const& items, std::array<uint8_t, MAX_SONG_LENGTH> const& refs) {
+        ItemSet changed = track_items[t] ^ items;
+        track_items[t] = items;
+        for (int i = 0; i < N; ++i) {
+            if (!changed[i]) continue;
+            int sign = items[i] ? 1 : -1;
+            for (int b = 0; b < MAX_SONG_LENGTH; ++b) {
+                if (!refs[b]) continue;
+                block_refs[i][b] += sign * refs[b];
+                blocks[i][b] = block_refs[i][b] > 0;
+            }
+        }
+    }
+};
+
+
+std::array<Song::Block, MAX_SONG_LENGTH>                        m_table;
+std::bitset<TRACK_COUNT>                                        m_empty;
+// number of channels per block that play the track
+std::array<std::array<uint8_t, MAX_SONG_LENGTH>, TRACK_COUNT>   m_track_refs;
+Users<INSTRUMENT_COUNT>                                         m_instruments;
+Users<EFFECT_COUNT>                                             m_effects;
+
+
+void add_block_ref(int t, int b, int delta) {
+    m_track_refs[t][b] += delta;
+    m_instruments.add_block_ref(t, b, delta);
+    m_effects.add_block_ref(t, b, delta);
+}
+
+
+// blocks and tracks the song does not hold are empty
+void update_block(Song const& song, int b) {
+    Song::Block const& block = *(Song::Block const*) chunk_data(song, CHUNK_BLOCK, b);
+    for (int c = 0; c < CHANNEL_COUNT; ++c) {
+        if (m_table[b][c]) add_block_ref(m_table[b][c] - 1, b, -1);
+        if (block[c]) add_block_ref(block[c] - 1, b, 1);
+    }
+    m_table[b] = block;
+}
+
+
+void update_track(Song const& song, int t) {
+    std::bitset<INSTRUMENT_COUNT> instruments;
+    std::bitset<EFFECT_COUNT>     effects;
+    bool empty = true;
+    Track const& track = *(Track const*) chunk_data(song, CHUNK_TRACK, t);
+    for (Track::Row const& row : track.rows) {
+        if (row.instrument) instruments[row.instrument - 1] = true;
+        if (row.effect) effects[row.effect - 1] = true;
+        if (row.note || row.instrument || row.effect) empty = false;
+    }
+    m_empty[t] = empty;
+    m_instruments.set_track_items(t, instruments, m_track_refs[t]);
+    m_effects.set_track_items(t, effects, m_track_refs[t]);
+}
+
+
+} // namespace
+
+
+void reset(Song const& song) {
+    m_table        = {};
+    m_track_refs   = {};
+    m_instruments  = {};
+    m_effects      = {};
+    for (int t = 0; t < TRACK_COUNT; ++t) update_track(song, t);
+    for (int b = 0; b < MAX_SONG_LENGTH; ++b) update_block(song, b);
+}
+
+
+void update(Song const& song, ChunkType type, int index) {
+    if (type == CHUNK_BLOCK) update_block(song, index);
+    if (type == CHUNK_TRACK) update_track(song, index);
+}
+
+
+bool            is_track_empty(int track)             { return m_empty[track - 1]; }
+BlockSet const& instrument_blocks(int instrument)     { return m_instruments.blocks[instrument - 1]; }
+BlockSet const& effect_blocks(int effect)             { return m_effects.blocks[effect - 1]; }
+
+
+} // namespace
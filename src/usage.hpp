@@ -0,0 +1,19 @@
+#pragma once
+#include "song.hpp"
+#include <bitset>
+
+
+// reverse index of the edited song: which tracks are empty,
+// and which blocks use an instrument or effect.
+// it is kept up to date by the history, one changed chunk at a time.
+// all ids are the 1-based numbers used in the song.
+namespace usage {
+    using BlockSet = std::bitset<MAX_SONG_LENGTH>;
+
+    void reset(Song const& song);
+    void update(Song const& song, ChunkType type, int index);
+
+    bool            is_track_empty(int track);
+    BlockSet const& instrument_blocks(int instrument);
+    BlockSet const& effect_blocks(int effect);
+}
@@ -0,0 +1,160 @@
+#include "wav.hpp"
+#include "player.hpp"
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+namespace wav {
+namespace {
+
+
+// file format:
+//
+//   "RIFF" u32 size "WAVE"
+//   "fmt " u32 16, u16 1 (pcm), u16 channels, u32 rate, u32 byte rate, u16 block align, u16 16
+//          for more than 2 channels the extensible form with u32 40, u16 0xfffe, the same fields,
+//          then u16 22, u16 16, u32 channel mask 0 and the pcm sub format guid
+//   "data" u32 size, frames
+//   "LIST" u32 size "INFO", "INAM" u32 size title, "IART" u32 size artist
+//
+// numbers are little-endian, chunks are padded to an even size.
+
+constexpr uint8_t PCM_GUID[16] = {
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71,
+};
+
+
+struct Header {
+    std::vector<uint8_t> data;
+
+    void u16(uint16_t v) { data.push_back(v); data.push_back(v >> 8); }
+    void u32(uint32_t v) { u16(v); u16(v >> 16); }
+    void bytes(void const* p, size_t len) {
+        data.insert(data.end(), (uint8_t const*) p, (uint8_t const*) p + len);
+    }
+    void string(char const* tag, std::string const& s) {
+        bytes(tag, 4);
+        u32(s.size() + 1);
+        bytes(s.c_str(), s.size() + 1);
+        if (data.size() & 1) data.push_back(0);
+    }
+};
+
+
+std::vector<uint8_t> make_header(int channels, uint32_t data_size, uint32_t info_size) {
+    bool extensible = channels > 2;
+    Header h;
+    h.bytes("RIFF", 4);
+    h.u32(0);
+    h.bytes("WAVE", 4);
+    h.bytes("fmt ", 4);
+    h.u32(extensible ? 40 : 16);
+    h.u16(extensible ? 0xfffe : 1);
+    h.u16(channels);
+    h.u32(MIXRATE);
+    h.u32(MIXRATE * channels * 2);
+    h.u16(channels * 2);
+    h.u16(16);
+    if (extensible) {
+        h.u16(22);
+        h.u16(16);
+        h.u32(0);
+        h.bytes(PCM_GUID, sizeof(PCM_GUID));
+    }
+    h.bytes("data", 4);
+    h.u32(data_size);
+
+    uint32_t riff_size = h.data.size() - 8 + data_size + info_size;
+    memcpy(&h.data[4], &riff_size, 4);
+    return h.data;
+}
+
+
+std::vector<uint8_t> make_info(std::string const& title, std::string const& artist) {
+    Header h;
+    h.bytes("LIST", 4);
+    h.u32(0);
+    h.bytes("INFO", 4);
+    h.string("INAM", title);
+    h.string("IART", artist);
+    uint32_t size = h.data.size() - 8;
+    memcpy(&h.data[4], &size, 4);
+    return h.data;
+}
+
+
+} // namespace
+
+
+bool Writer::open(std::string const& path, int channels, int frames,
+                  std::string const& title, std::string const& artist) {
+    close(0);
+
+    std::vector<uint8_t> info = make_info(title, artist);
+    uint64_t data_size = uint64_t(frames) * channels * 2;
+    std::vector<uint8_t> header = make_header(channels, data_size, info.size());
+    uint64_t size = header.size() + data_size + (data_size & 1) + info.size();
+    if (size > UINT32_MAX) return false;
+
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) return false;
+
+    // reserve the blocks now, running out of space later would fault while writing to the map
+    int err = posix_fallocate(m_fd, 0, size);
+    if ((err != 0 && err != EOPNOTSUPP && err != EINVAL) || ftruncate(m_fd, size) == -1) {
+        ::close(m_fd);
+        m_fd = -1;
+        unlink(path.c_str());
+        return false;
+    }
+
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+        ::close(m_fd);
+        m_fd = -1;
+        unlink(path.c_str());
+        return false;
+    }
+
+    m_data        = (uint8_t*) p;
+    m_size        = size;
+    m_channels    = channels;
+    m_frame_count = frames;
+    memcpy(m_data, header.data(), header.size());
+    memcpy(m_data + size - info.size(), info.data(), info.size());
+    m_frames = (short*) (m_data + header.size());
+    return true;
+}
+
+
+bool Writer::close(int frames_written) {
+    if (!m_data) return false;
+
+    // a short file loses its info chunk, it is cut right after the frames
+    size_t size = m_size;
+    if (frames_written < m_frame_count) {
+        uint32_t data_size = uint32_t(frames_written) * m_channels * 2;
+        std::vector<uint8_t> header = make_header(m_channels, data_size, 0);
+        memcpy(m_data, header.data(), header.size());
+        size = header.size() + data_size;
+    }
+
+    munmap(m_data, m_size);
+    bool ok = ftruncate(m_fd, size) == 0;
+    ::close(m_fd);
+
+    m_fd          = -1;
+    m_data        = nullptr;
+    m_size        = 0;
+    m_frames      = nullptr;
+    m_channels    = 0;
+    m_frame_count = 0;
+    return ok;
+}
+
+
+} // namespace
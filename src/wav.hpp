@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+
+// 16 bit pcm wav files written in place: the file is sized for the whole song up front
+// and memory-mapped, so samples can be rendered straight into it
+namespace wav {
+    struct Writer {
+        Writer() = default;
+        Writer(Writer const&) = delete;
+        Writer& operator=(Writer const&) = delete;
+        ~Writer() { close(0); }
+
+        // fails if the data would not fit the 32 bit sizes of the format
+        bool   open(std::string const& path, int channels, int frames,
+                    std::string const& title, std::string const& artist);
+        // the header is fixed up if fewer frames were written, e.g. after a cancel
+        bool   close(int frames_written);
+
+        // interleaved frames in host byte order, which is little-endian on all our targets
+        short* frames() const { return m_frames; }
+        int    channels() const { return m_channels; }
+        int    frame_count() const { return m_frame_count; }
+
+        int      m_fd          = -1;
+        uint8_t* m_data        = nullptr;
+        size_t   m_size        = 0;
+        short*   m_frames      = nullptr;
+        int      m_channels    = 0;
+        int      m_frame_count = 0;
+    };
+}